@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "bench.h"
+
+// Synthetic payload sizes, close to what a GR II writes
+#define BENCH_JPG_SIZE (6ULL * 1024 * 1024)
+#define BENCH_DNG_SIZE (24ULL * 1024 * 1024)
+#define BENCH_CHUNK 65536
+#define BENCH_REQUEST_MAX 8192
+
+// Structure for the mock camera state
+struct bench_server {
+    int fd;                  // Listening socket, -1 when stopped
+    pthread_t thread;        // Accept loop
+    int accepting;           // Accept loop running
+    char* listing;           // Recorded /_gr/objs response
+    size_t listing_len;
+    char payload[BENCH_CHUNK];
+};
+
+static struct bench_server server = { .fd = -1 };
+
+// Function to send a whole buffer on a connection
+static int bench_send(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Function to send a response header followed by an optional body
+static int bench_send_header(int fd, const char* status, uint64_t length, const char* extra) {
+    char header[512];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 %s\r\nContent-Length: %llu\r\n%sConnection: keep-alive\r\n\r\n",
+                       status, (unsigned long long)length, extra);
+    return bench_send(fd, header, (size_t)len);
+}
+
+// Function to serve a synthetic photo, honouring a "Range: bytes=N-" request for resume
+static int bench_send_photo(int fd, const char* path, const char* request, int head_only) {
+    const char* ext = strrchr(path, '.');
+    uint64_t size = ext && strcasecmp(ext, ".DNG") == 0 ? BENCH_DNG_SIZE : BENCH_JPG_SIZE;
+    uint64_t from = 0;
+    char extra[128] = "";
+    
+    const char* range = strcasestr(request, "\r\nRange: bytes=");
+    if (range) {
+        from = strtoull(range + 15, NULL, 10);
+        if (from >= size) {
+            return bench_send_header(fd, "416 Range Not Satisfiable", 0, "");
+        }
+        snprintf(extra, sizeof(extra), "Content-Range: bytes %llu-%llu/%llu\r\n",
+                 (unsigned long long)from, (unsigned long long)(size - 1), (unsigned long long)size);
+    }
+    
+    if (bench_send_header(fd, range ? "206 Partial Content" : "200 OK", size - from, extra) != 0) {
+        return -1;
+    }
+    if (head_only) {
+        return 0;
+    }
+    for (uint64_t left = size - from; left > 0; ) {
+        size_t n = left < BENCH_CHUNK ? (size_t)left : BENCH_CHUNK;
+        if (bench_send(fd, server.payload, n) != 0) {
+            return -1;
+        }
+        left -= n;
+    }
+    return 0;
+}
+
+// Function to answer one request. Returns -1 when the connection should be closed.
+static int bench_respond(int fd, const char* request) {
+    char method[8];
+    char path[1024];
+    
+    if (sscanf(request, "%7s %1023s", method, path) != 2) {
+        return -1;
+    }
+    int head_only = strcmp(method, "HEAD") == 0;
+    
+    if (strcmp(path, "/_gr/objs") == 0) {
+        if (bench_send_header(fd, "200 OK", server.listing_len, "Content-Type: application/json\r\n") != 0) {
+            return -1;
+        }
+        return head_only ? 0 : bench_send(fd, server.listing, server.listing_len);
+    }
+    if (strncmp(path, "/v1/photos/", 11) == 0) {
+        return bench_send_photo(fd, path, request, head_only);
+    }
+    return bench_send_header(fd, "404 Not Found", 0, "");
+}
+
+// Function to serve the requests of one keep-alive connection
+static void* bench_connection(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    char request[BENCH_REQUEST_MAX + 1];
+    size_t len = 0;
+    
+    for (;;) {
+        request[len] = '\0';
+        char* end = strstr(request, "\r\n\r\n");
+        if (end) {
+            size_t consumed = (size_t)(end + 4 - request);
+            end[2] = '\0';
+            if (bench_respond(fd, request) != 0) {
+                break;
+            }
+            memmove(request, request + consumed, len - consumed);
+            len -= consumed;
+            continue;
+        }
+        if (len == BENCH_REQUEST_MAX) {
+            break;
+        }
+        ssize_t n = recv(fd, request + len, BENCH_REQUEST_MAX - len, 0);
+        if (n <= 0) {
+            break;
+        }
+        len += (size_t)n;
+    }
+    
+    close(fd);
+    return NULL;
+}
+
+// Function to accept connections until the listening socket is shut down
+static void* bench_accept(void* arg) {
+    (void)arg;
+    
+    for (;;) {
+        int fd = accept(server.fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, bench_connection, (void*)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// Function to read the recorded listing into memory
+static int bench_load_listing(const char* listing_path) {
+    FILE* fp = fopen(listing_path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Cannot open benchmark listing %s: %s\n", listing_path, strerror(errno));
+        return -1;
+    }
+    
+    size_t capacity = 65536;
+    server.listing = malloc(capacity);
+    server.listing_len = 0;
+    while (server.listing) {
+        server.listing_len += fread(server.listing + server.listing_len, 1, capacity - server.listing_len, fp);
+        if (server.listing_len < capacity) {
+            break;
+        }
+        capacity *= 2;
+        char* grown = realloc(server.listing, capacity);
+        if (!grown) {
+            free(server.listing);
+        }
+        server.listing = grown;
+    }
+    
+    int failed = ferror(fp);
+    fclose(fp);
+    if (!server.listing || failed) {
+        fprintf(stderr, "Cannot read benchmark listing %s\n", listing_path);
+        free(server.listing);
+        server.listing = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to start the mock camera on an ephemeral loopback port
+int bench_server_start(const char* listing_path, int* port) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    
+    if (bench_load_listing(listing_path) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(server.payload); i++) {
+        server.payload[i] = (char)(i * 31 + (i >> 8));
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    
+    server.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server.fd < 0 ||
+        bind(server.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(server.fd, 64) != 0 ||
+        getsockname(server.fd, (struct sockaddr*)&addr, &addr_len) != 0) {
+        perror("mock camera");
+        bench_server_stop();
+        return -1;
+    }
+    
+    if (pthread_create(&server.thread, NULL, bench_accept, NULL) != 0) {
+        fprintf(stderr, "Failed to start mock camera\n");
+        bench_server_stop();
+        return -1;
+    }
+    server.accepting = 1;
+    
+    *port = ntohs(addr.sin_port);
+    printf("Mock camera listening on 127.0.0.1:%d\n", *port);
+    return 0;
+}
+
+// Function to stop accepting connections and release the listing
+void bench_server_stop(void) {
+    if (server.fd >= 0) {
+        // Shutting the socket down wakes the accept loop
+        shutdown(server.fd, SHUT_RDWR);
+        if (server.accepting) {
+            pthread_join(server.thread, NULL);
+            server.accepting = 0;
+        }
+        close(server.fd);
+        server.fd = -1;
+    }
+    free(server.listing);
+    server.listing = NULL;
+}
+
+// Function to order latencies for the percentile lookup
+static int bench_compare_latency(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Function to pick a nearest-rank percentile from sorted latencies
+static double bench_percentile(const double* sorted, int count, int percent) {
+    int rank = (count * percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Function to print the benchmark summary
+void bench_report(int files, uint64_t bytes, double seconds, double* latencies, int latency_count) {
+    struct rusage usage;
+    double mb = (double)bytes / (1024.0 * 1024.0);
+    
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    
+    printf("\nBenchmark results:\n");
+    printf("  Files:      %d (%.1f MB) in %.2f s\n", files, mb, seconds);
+    printf("  Throughput: %.1f files/s, %.1f MB/s\n", files / seconds, mb / seconds);
+    if (latency_count > 0) {
+        qsort(latencies, latency_count, sizeof(double), bench_compare_latency);
+        printf("  Latency:    p50 %.1f ms, p99 %.1f ms\n",
+               bench_percentile(latencies, latency_count, 50) * 1000.0,
+               bench_percentile(latencies, latency_count, 99) * 1000.0);
+    }
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        printf("  Peak RSS:   %ld KB\n", usage.ru_maxrss);
+    }
+}
+
+// Function to remove one entry of the scratch directory, children first
+static int bench_remove_entry(const char* path, const struct stat* sb, int type, struct FTW* ftw) {
+    (void)sb;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+// Function to remove the scratch directory tree
+int bench_remove_tree(const char* path) {
+    return nftw(path, bench_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
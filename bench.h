@@ -0,0 +1,20 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+// Benchmark support, built only with -DWITH_BENCH (make bench)
+
+// Function to start the mock camera on a loopback port, serving the recorded listing at /_gr/objs
+int bench_server_start(const char* listing_path, int* port);
+
+// Function to stop the mock camera
+void bench_server_stop(void);
+
+// Function to print throughput, per-file latency percentiles and peak memory of a run
+void bench_report(int files, uint64_t bytes, double seconds, double* latencies, int latency_count);
+
+// Function to remove the scratch directory a benchmark imported into
+int bench_remove_tree(const char* path);
+
+#endif
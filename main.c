@@ -8,8 +8,25 @@
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
-#include <cjson/cJSON.h>
+#include <stdint.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#ifdef WITH_BENCH
+#include "bench.h"
+#endif
+#include "trace.h"
+
+// Trace tracks: one per download slot, listing request and writer thread
+#define TRACE_SLOT_TRACK 1
+#define TRACE_LISTING_TRACK 1000
+#define TRACE_WRITER_TRACK 2000
+#define TRACE_SLOT(xfer) (TRACE_SLOT_TRACK + (int)((xfer) - (xfer)->session->slots))
 
 // Buffer size constants
 #define MAX_FILENAME 256
@@ -19,36 +36,738 @@
 #define MAX_PATH 512
 #define MAX_URL 512
 #define MAX_FILEPATH 1024
+#define MAX_JOBS 16
+#define MAX_CAMERAS 8
+#define MAX_TARGETS 4
+#define MAX_LABEL 32
+#define PART_SUFFIX ".part"
+#define MAX_RETRY_DELAY 60.0
+#define MAX_QUEUED_PHOTOS 256
+#define INDEX_FILENAME ".rgr2import.index"
+#define INDEX_MAGIC "RGR2IDX2"
+#define INDEX_MAGIC_V1 "RGR2IDX1"
+#define MARK_FILENAME ".rgr2import.mark"
+#define LISTING_FILENAME ".rgr2import.listing"
+#define LISTING_MAGIC "RGR2LST1"
+#define MAX_VALIDATOR 128
+#define LISTING_MEMORY_MAX (4 * 1024 * 1024)
+#define LISTING_CHUNK 65536
+#define THROUGHPUT_FILENAME ".rgr2import.throughput"
+#define DEFAULT_URL "http://192.168.0.1"
+#define PROGRESS_BAR_INTERVAL 0.1
+#define PROGRESS_LINE_INTERVAL 10.0
+#define WRITE_ALIGN 4096
+#define DEFAULT_WRITE_BUFFER (1024 * 1024)
+#define MAX_WRITE_BUFFER (64 * 1024 * 1024)
+#define MAX_RECEIVE_BUFFER (512 * 1024)
+#define PROBE_TIMEOUT_MS 2000L
+#define SLOW_WRITE_SECONDS 1.0
+#define PREVIEW_DIRNAME ".previews"
+#define DEFAULT_PREVIEW_CACHE_MB 512
+#define ADAPT_MAX_JOBS 8
+#define ADAPT_START 2
+#define ADAPT_WINDOW 2.0
+#define ADAPT_MIN_GAIN 0.05
+#define ADAPT_TTFB_FACTOR 3.0
+#define ADAPT_HOLD 5
+#define MAX_POST_COMMANDS 4
+#define DEFAULT_POST_JOBS 2
+#define POST_MAX_OPEN 64
+#define DEFAULT_COMMIT_FILES 32
+#define MAX_COMMIT_FILES 256
+#define DEFAULT_COMMIT_SECONDS 10
+
+// Structure to hold photo information; the strings live in the arena of the photo list
+struct photo {
+    uint64_t size;          // Size from the "s" field, 0 when the camera does not report it
+    uint32_t name;          // Arena offset of the name
+    uint32_t date;          // Date from the "d" field packed as YYYYMMDD, today when missing
+    uint32_t time;          // Time of day packed as hhmmss
+    uint16_t tag;           // Index of the interned directory tag
+    unsigned char dated;    // Date and time came from the listing
+    unsigned char outcome;  // enum photo_outcome, filled in as the run progresses
+};
+
+// Structure for the incremental import high-water mark
+struct watermark {
+    uint64_t taken;            // Capture time packed as YYYYMMDDhhmmss
+    char tag[MAX_TAG];
+    char name[MAX_FILENAME];
+};
+
+// Streaming parser for the /_gr/objs listing
+#define JSON_MAX_DEPTH 32
+#define JSON_MAX_KEY 16
+
+// Meaning of a container within the listing
+enum objs_role {
+    ROLE_OTHER = 0,
+    ROLE_ROOT,     // The top-level object
+    ROLE_DIRS,     // The "dirs" array
+    ROLE_DIR,      // One directory object
+    ROLE_FILES,    // The "files" array of a directory
+    ROLE_FILE      // One file object
+};
+
+// What may come next inside a container
+enum json_expect {
+    EXPECT_VALUE = 0,
+    EXPECT_KEY,
+    EXPECT_KEY_OR_END,
+    EXPECT_VALUE_OR_END,
+    EXPECT_COLON,
+    EXPECT_COMMA_OR_END,
+    EXPECT_NOTHING
+};
+
+// Token the lexer is in the middle of
+enum json_lex {
+    LEX_NONE = 0,
+    LEX_STRING,
+    LEX_ESCAPE,
+    LEX_UNICODE,
+    LEX_NUMBER,
+    LEX_LITERAL
+};
+
+// Listing field a scalar value is stored into
+enum objs_target {
+    TARGET_NONE = 0,
+    TARGET_TAG,    // "name" of a directory
+    TARGET_NAME,   // "n" of a file
+    TARGET_DATE,   // "d" of a file
+    TARGET_SIZE    // "s" of a file
+};
+
+struct json_level {
+    unsigned char is_object;
+    unsigned char role;
+    unsigned char expect;
+};
+
+// A file entry as it appears in the listing
+struct objs_file_entry {
+    char name[MAX_FILENAME];
+    char date[MAX_DATE];
+    int has_date;
+    uint64_t size;
+};
+
+// Structure for the incremental listing parser, fed chunk by chunk from the curl write callback
+struct objs_parser {
+    struct json_level stack[JSON_MAX_DEPTH];
+    int depth;
+    unsigned char expect_top;     // Expectation outside of any container
+    unsigned char lex;
+    unsigned char target;
+    int in_key;
+    char key[JSON_MAX_KEY];
+    int key_len;
+    char token[MAX_FILENAME];
+    size_t token_len;
+    unsigned unicode;
+    int unicode_digits;
+    size_t offset;                // Bytes consumed so far, for error messages
+    const char* error;
+    
+    int saw_dirs;
+    char tag[MAX_TAG];            // Raw name of the current directory
+    int have_tag;
+    struct objs_file_entry file;  // File entry being parsed
+    struct objs_file_entry* pending;  // Entries seen before their directory name
+    int pending_count;
+    int pending_capacity;
+    
+    int (*on_dir)(void* ctx, const char* tag);
+    int (*on_file)(void* ctx, const char* name, const char* date, uint64_t size);
+    void* ctx;
+};
+
+// Layouts of the date folders below the target directory
+enum folder_layout {
+    LAYOUT_DAY = 0,    // YYYY-MM-DD
+    LAYOUT_NESTED,     // YYYY/MM/DD
+    LAYOUT_MONTH       // YYYY/MM
+};
+
+// Structure for the set of folders already ensured in this run. Keys are the packed
+// date truncated to a layout level, with the level in the top bits; 0 marks a free slot.
+struct dir_cache {
+    uint32_t* keys;
+    size_t capacity;   // Power of two
+    size_t count;
+};
+
+// Order in which queued photos are handed to the downloads
+enum order_policy {
+    ORDER_LISTING = 0,   // As the camera lists them, oldest first
+    ORDER_NEWEST,        // Latest capture time first
+    ORDER_JPG_FIRST,     // JPG previews before the DNG raws
+    ORDER_SMALLEST       // Smallest first, for the most files in a short window
+};
 
-// Structure to hold response data
-struct http_response {
+// Structure for an explicit priority list; entries are NAME or TAG/NAME, sorted for lookup
+struct priority_entry {
+    char* key;
+    int rank;        // Line of the entry, earlier lines go first
+};
+
+struct priority_list {
+    struct priority_entry* entries;
+    int count;
+};
+
+// Structure for the photos a selective import asks for (-F and --files-from), NAME or TAG/NAME keys
+// in an open-addressing table so that each listing entry costs one or two lookups however many are asked for
+struct name_set {
+    char** keys;     // Capacity is a power of two, NULL marks a free slot
+    size_t capacity;
+    int count;
+};
+
+// Sort key of a photo in the scheduler
+struct schedule_key {
+    int rank;        // Position in the priority list, INT_MAX when not listed
+    uint64_t key;    // Policy key, ascending
+    int index;       // Listing position, keeps equal keys in listing order
+};
+
+// Streaming XXH64 state, fed from the write callback so a file is hashed without reading it back
+struct xxh64 {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char stripe[32];
+    size_t buffered;
+};
+
+// Growable byte buffer of the listing cache. Past LISTING_MEMORY_MAX the bytes move on to an unlinked
+// temporary file, so a huge card costs disk space rather than memory.
+struct listing_buffer {
     char* data;
-    size_t size;
+    size_t len;
+    size_t capacity;
+    FILE* spill;         // Bytes before data, NULL until the buffer first filled up
+    uint64_t spilled;
 };
 
-// Structure to hold photo information
-struct photo {
+// Listing cache record, followed by name_len bytes of the file name, or of the tag for a directory
+struct listing_record {
+    uint64_t size;
+    uint64_t taken;      // Capture time packed as YYYYMMDDhhmmss, 0 when unknown
+    uint8_t is_dir;
+    uint8_t name_len;
+    uint16_t reserved;
+    uint32_t reserved2;
+};
+
+// Header of the listing cache file after its magic; the records and then the raw body follow
+struct listing_cache_header {
+    uint64_t body_len;
+    uint64_t body_hash;                  // XXH64 of the body
+    uint64_t records_len;
+    uint64_t records_hash;               // XXH64 of the records
+    char etag[MAX_VALIDATOR];            // Validators the camera sent with the body, empty when none
+    char last_modified[MAX_VALIDATOR];
+};
+
+// Structure for the listing cache of a camera: the fingerprint of the last listing and what this run saves
+struct listing_cache {
+    char path[MAX_FILEPATH];
+    struct listing_cache_header cached;  // Fingerprint of the listing on disk
+    int loaded;                          // A cached listing was found
+    struct listing_cache_header fresh;   // Fingerprint of this response
+    struct listing_buffer body;          // Raw bytes of this response
+    struct listing_buffer records;       // Every entry of this response, before any filter
+    struct xxh64 hash;
+    struct curl_slist* headers;          // Conditional request headers
+    int checked;                         // Response headers looked at
+    int deferred;                        // Parsing waits until the body is known to differ from the cached one
+    int reused;                          // The cached records stood in for the response
+};
+
+// Structure collecting photo records as the listing is parsed
+struct photo_list {
+    struct photo* photos;
+    int count;
+    int capacity;
+    char* arena;                   // Names and tags, each NUL-terminated
+    size_t arena_len;
+    size_t arena_capacity;
+    uint32_t* tags;                // Arena offsets of the interned directory tags
+    int tag_count;
+    int tag_capacity;
+    int current_tag;               // Tag of the directory being listed
+    int next;                      // Next photo to hand to the downloads; later ones are still queued
+    const struct watermark* mark;  // Drop entries at or below this mark, NULL for none
+    int policy;                    // enum order_policy
+    const struct priority_list* priority;  // Photos to fetch first, NULL for none
+    int ordered;                   // Dispatch waits for the whole listing and follows order[]
+    int scheduled;                 // order[] is final and photos may go out
+    int* order;                    // Photo indices in dispatch order, NULL for listing order
+    int below_mark;
+    const char* format;            // -f filter, applied as entries are parsed
+    const struct name_set* names;  // -F and --files-from filter, NULL for every photo
+    int filtered;                  // Entries dropped by -f or -F
+    uint32_t today;                // Date for entries without one, taken once per run
+    struct listing_buffer* records;  // Every entry is kept here for the listing cache, NULL when not
+};
+
+// Structure for the listing transfer, run alongside the downloads it feeds
+struct listing {
+    CURL* curl;
+    struct objs_parser parser;
+    struct photo_list list;
+    struct listing_cache cache;
+    int running;     // Transfer still in progress
+    int paused;      // Receiving held back because the download queue is full
+    int complete;    // Whole listing received and parsed
+    double parse_seconds;  // Time spent parsing, for the metrics
+    double seconds;        // Request timings, for the metrics
+    double ttfb;
+    double connect;
+    uint64_t bytes;
+#ifdef WITH_TRACE
+    int track;       // Trace track of the listing request
+#endif
+};
+
+// Per-photo outcome of a run, used to advance the watermark
+enum photo_outcome {
+    OUTCOME_NONE = 0,   // Filtered out or never attempted
+    OUTCOME_DONE,       // Imported now or earlier
+    OUTCOME_FAILED      // Failed for good
+};
+
+// On-disk import index record, followed by tag_len tag bytes and name_len name bytes (native byte order)
+struct index_record {
+    uint64_t size;      // File size in bytes, 0 when unknown
+    uint64_t content;   // XXH64 of the file, 0 when it was not hashed
+    uint32_t date;      // Date folder packed as YYYYMMDD
+    uint8_t tag_len;
+    uint8_t name_len;
+    uint16_t reserved;
+};
+
+// Record of the first index format, without a content hash; read and upgraded on open
+struct index_record_v1 {
+    uint64_t size;
+    uint32_t date;
+    uint8_t tag_len;
+    uint8_t name_len;
+    uint16_t reserved;
+};
+
+// In-memory import index entry; key holds "tag\0name\0"
+struct index_entry {
+    char* key;
+    uint64_t hash;
+    uint64_t size;
+    uint64_t content;
+    uint32_t date;
+    uint8_t tag_len;
+};
+
+// Entry of the table of imported contents, for spotting the same bytes under another name
+struct content_entry {
+    uint64_t content;   // 0 marks a free slot
+    uint64_t size;
+    const char* key;    // Key of the index entry, owned by the index
+};
+
+// Structure for the persistent index of imported photos, an append-only log loaded into a hash table
+struct import_index {
+    char path[MAX_FILEPATH];
+    FILE* log;                    // Log opened for appending, NULL when it cannot be written
+    struct index_entry* entries;  // Open-addressing table, capacity is a power of two
+    size_t capacity;
+    size_t count;
+    struct content_entry* contents;  // Open-addressing table of hashed entries
+    size_t content_capacity;
+    size_t content_count;
+};
+
+// How progress is reported
+enum progress_mode {
+    PROGRESS_AUTO = 0,   // Status line on a terminal, periodic lines otherwise
+    PROGRESS_BAR,        // Status line redrawn in place
+    PROGRESS_LINES,      // A full line now and then, for logs
+    PROGRESS_NONE
+};
+
+// Structure for the progress display, aggregated over all transfers and redrawn at a fixed rate
+struct progress {
+    int mode;              // enum progress_mode, never AUTO once the run started
+    double interval;       // Seconds between redraws
+    double next_draw;      // Monotonic time of the next redraw
+    int drawn;             // The status line is on screen and must be cleared before other output
+    uint64_t last_bytes;   // Bytes received at the previous redraw
+    double last_time;
+    double rate;           // Smoothed bytes per second
+};
+
+// Structure for the file a download is written to on one target directory
+struct transfer_output {
+    int fd;                       // Partial file, -1 when closed
+    char* buffer;                 // Aligned write buffer of session->write_buffer bytes, one per target
+    size_t buffered;              // Bytes waiting in the buffer
+    int direct;                   // File opened with O_DIRECT
+    int preallocated;             // Space reservation attempted for this file
+    uint64_t unsynced;            // Bytes written since the last fdatasync
+    int active;                   // This copy is being written; cleared when an additional target gives up
+    struct write_block* block;    // Write pool block being filled, NULL for none
+    int pending;                  // Blocks queued to the writer thread, guarded by the pool lock
+    int failed;                   // A queued block could not be written, guarded by the pool lock
+    int sealed;                   // The last block of the file was queued
+    char filepath[MAX_FILEPATH];
+    char partpath[MAX_FILEPATH];  // Partial download, renamed to filepath once complete
+};
+
+// Structure for one download slot; its easy handle is reused for every photo it fetches
+struct transfer {
+    struct transfer_session* session;
+    struct camera* camera;        // Camera the slot downloads from
+    CURL* curl;
+    struct transfer_output out[MAX_TARGETS];  // The primary target first, then the additional ones
+    curl_off_t resume_from;       // Bytes already on disk when the transfer started
+    curl_off_t size;              // Final file size, set by download_finish()
+    uint64_t expected;            // Size the file should end up with, 0 when unknown
+    int hashing;                  // Hash the data as it arrives
+    struct xxh64 hash;            // Running hash of the file, partial part included
+    uint64_t content;             // Final hash, set by download_finish() when hashing
+    char name[MAX_FILENAME];      // Photo being fetched, for messages
+    int photo_index;              // Index into photos[] of the photo being fetched
+    int attempt;                  // Number of earlier failed attempts for this photo
+    int retryable;                // Set by download_finish() when the failure is transient
+    int handoff;                  // Descriptor of the completed file for post-processing, -1 for none
+    int paused;                   // Held back until the write pool has blocks free again
+    double paused_at;             // Monotonic time the transfer was paused
+    int draining;                 // Received in full, the writer threads still have blocks of it
+    CURLcode result;              // Outcome of a draining transfer
+    int active;
+};
+
+// Structure for a failed download waiting for its backoff to expire
+struct pending_retry {
+    int index;     // Index into photos[]
+    int attempt;   // Attempt number of the next try
+    double due;    // Monotonic time when the retry may start
+};
+
+// Structure for the adaptive concurrency controller of one camera, judged over fixed windows
+struct adaptive {
+    int limit;                    // Transfers allowed in flight, session->jobs when not adapting
+    double window_start;          // Monotonic start of the current window
+    uint64_t bytes;               // Bytes received during the window
+    double ttfb_sum;              // Time to first byte of the transfers that finished during the window
+    int finished;
+    int failures;                 // Transfers that failed or stalled during the window
+    int starved;                  // A slot stayed free for lack of work, the window says nothing about the limit
+    double last_rate;             // Throughput of the last window that was judged
+    double best_ttfb;             // Lowest mean time to first byte seen, the unloaded baseline
+    int grew;                     // The last decision added a transfer
+    int shrank;                   // The last decision removed transfers, this window still saw the old load
+    int hold;                     // Windows to wait at the knee before probing upward again
+    int increases;
+    int decreases;
+};
+
+// Structure for one camera of the run, with its own listing pipeline, retry queue and watermark
+struct camera {
+    const char* url;              // Base address without a trailing slash
+    const char* label;            // Prefixes file names and index tags, empty for a lone camera
+    struct listing listing;
+    struct pending_retry* retries;  // Failed downloads waiting for their backoff
+    int retry_count;
+    int retry_capacity;
+    int active;                   // Downloads in flight
+    int downloaded;               // Photos imported now or earlier
+    struct watermark mark;
+    int have_mark;
+    int present;                  // Answered the last probe, in watch mode
+    int wanted;                   // Takes part in the next import
+    struct adaptive adapt;
+};
+
+// Structure for the timings of one finished download attempt, taken from CURLINFO
+struct transfer_stat {
+    const struct camera* camera;
+    int photo_index;
+    int attempt;          // Earlier failed attempts for this photo
+    int ok;
+    uint64_t bytes;       // Bytes received by this attempt
+    double seconds;       // Total time of the request
+    double connect;       // Time until connected, 0 on a reused connection
+    double ttfb;          // Time until the first response byte
+    double speed;         // Average bytes per second
+    long connects;        // New connections the attempt opened
+};
+
+// Structure for a completed download on its way to the index; in durable mode it waits for its batch to commit
+struct completed_file {
+    struct camera* camera;
+    int photo_index;              // Index into photos[]
+    uint64_t size;
+    uint64_t content;             // Hash of the file, 0 when not hashed
+    int handoff;                  // Descriptor of the file for post-processing, -1 for none
+    int targets;                  // Bit mask of the targets holding a copy
+    int duplicate;                // Dropped as a copy of an imported photo
+    char filepath[MAX_TARGETS][MAX_FILEPATH];  // Final names; until the commit the data is in PART_SUFFIX files
+};
+
+// Structure for the downloads that complete before one group sync makes them durable
+struct commit_batch {
+    struct completed_file* files; // session->commit_files entries
+    int count;
+    double opened;                // Monotonic time the first file of the batch completed
+    int batches;                  // Batches committed in this run
+    int committed;                // Files published by them
+    double sync_seconds;          // Time spent syncing them
+};
+
+// Structure for a completed photo waiting for post-processing
+struct post_job {
+    struct post_job* next;
+    int fd;                       // Descriptor of the file as it was written, -1 when too many are held open
+    uint64_t size;
+    uint32_t date;
+    char path[MAX_FILEPATH];
     char name[MAX_FILENAME];
     char tag[MAX_TAG];
-    char date[MAX_DATE];  // Date extracted from "d" field
+    char label[MAX_LABEL];
+};
+
+// Structure for the post-processing workers, fed by download completions while later photos download
+struct post_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;         // A job was queued or the pool is stopping
+    pthread_cond_t idle;          // The queue ran empty and no job is running
+    pthread_t threads[MAX_JOBS];
+    int thread_count;
+    struct post_job* head;        // Jobs in completion order
+    struct post_job* tail;
+    int queued;
+    int running;
+    int stopping;
+    int processed;                // Files handled in this run
+    int failed;                   // Files a handler failed on
+    const struct cli_options* options;  // Hook commands and backup directory
+    const char* base_path;        // Root of the imported tree, mirrored below the backup directory
+};
+
+// Structure for a directory every download is written to, with what writing to it cost in this run
+struct write_target {
+    const char* path;
+    uint64_t bytes;               // Bytes written
+    double write_seconds;         // Time spent in write and fdatasync
+    int slow_writes;              // Flushes that held the transfer up for SLOW_WRITE_SECONDS or more
+    int failed;                   // Copies given up after an error
+};
+
+// Structure for a receive buffer of the write pool, filled by the write callback and written out by a writer thread
+struct write_block {
+    struct write_block* next;
+    char* data;                   // Aligned, session->write_buffer bytes
+    size_t len;                   // Bytes filled
+    struct transfer_output* out;  // Copy of the download the data belongs to
+    int final;                    // Last block of the file, synced once written
+};
+
+// Structure for the blocks waiting for the writer thread of one target, which keeps the blocks of a file in order
+struct write_queue {
+    pthread_cond_t ready;         // A block was queued or the pool is stopping
+    pthread_t thread;
+    int started;
+    struct write_block* head;
+    struct write_block* tail;
+    struct write_pool* pool;
+    int target;                   // Index into session->targets[]
+    struct write_target written;  // Write figures not yet added to the target, under the lock
 };
 
-// Structure for progress tracking
-struct progress_data {
-    char filename[MAX_FILENAME];
+// Structure for the write pool: data is copied out of the network callback into preallocated blocks
+// and written by one thread per target, so a slow disk only holds up transfers once every block is taken
+struct write_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t returned;      // A written block went back to the free list
+    char* memory;                 // Data of every block, one aligned allocation
+    struct write_block* blocks;
+    int count;
+    struct write_block* free_list;
+    int free_count;
+    int waiting;                  // The transfer loop sleeps on paused or draining transfers and wants a wakeup
+    int stopping;
+    int peak_in_use;              // Most blocks taken at once in this run
+    int pauses;                   // Transfers paused for want of a block in this run
+    double paused_seconds;        // Time transfers spent paused in this run
+    struct write_queue queues[MAX_TARGETS];
+    struct transfer_session* session;
+};
+
+// Structure for a persistent transfer session shared by the listing and all downloads
+struct transfer_session {
+    CURLM* multi;            // Multi handle, owns the connection cache kept alive across requests
+    CURL** listings;         // Handle for the listing request of each camera
+    int camera_count;
+    struct transfer* slots;  // jobs slots per camera, the slots of a camera are adjacent
+    int slot_count;
+    int jobs;                // Maximum number of transfers in flight per camera
+    long stall_speed;        // Bytes per second below which a transfer counts as stalled
+    long stall_time;         // Seconds a transfer may stay below stall_speed before it is aborted
+    long connections;        // Number of connections actually opened during the run
+    int retries;             // Number of retries scheduled
+    int stalls;              // Number of transfers aborted as stalled
+    double stall_seconds;    // Time spent in transfers that ended up stalled
+    double started;          // Monotonic time the run started
+    double first_byte;       // Monotonic time the first photo byte arrived, 0 until then
+    uint64_t bytes;          // Bytes received for completed photos
+    int completed;           // Photos downloaded in this run
+    struct transfer_stat* stats;  // Every finished download attempt, in completion order
+    int stat_count;
+    int stat_capacity;
+    int skipped_existing;    // Photos found on disk
+    int skipped_index;       // Photos the import index already knew
+    struct progress progress;
+    size_t write_buffer;     // Bytes collected per transfer before they are written out
+    int direct;              // Write new files with O_DIRECT
+    uint64_t sync_bytes;     // fdatasync after this many bytes written to a file, 0 for never
+    int layout;              // enum folder_layout
+    int verify;              // Hash downloads, check sizes and drop duplicate contents
+    int duplicates;          // Downloads dropped as a copy of an imported photo
+    int repaired;            // Short files found on disk and fetched again
+    struct dir_cache dirs;   // Date folders known to exist
+    struct post_pool* post;  // Post-processing of completed files, NULL for none
+    struct write_pool* pool; // Writer threads taking the file writes off the transfer loop, NULL to write in place
+    struct write_target targets[MAX_TARGETS];  // The primary target decides what is imported
+    int target_count;
+    const char* preview;     // Size variant fetched instead of the photo ("view", "thumb"), NULL for full imports
+    const char* preview_dir; // Preview cache whose entries a full import upgrades, NULL when there is none
+    int adaptive;            // Tune the transfers in flight per camera, with jobs as the ceiling
+    int commit_files;        // Publish completed files in synced batches of this many, 0 to publish each at once
+    double commit_seconds;   // Commit a smaller batch once its first file has waited this long
+    struct commit_batch batch;
+};
+
+// Structure for a camera given on the command line
+struct camera_address {
+    char url[MAX_URL];            // Without a trailing slash
+    char label[MAX_LABEL];        // Empty for a lone camera
 };
 
 // Structure for CLI options
 struct cli_options {
     char format[MAX_FORMAT];      // "dng", "jpg", "all"
     char filename[MAX_FILENAME];  // Specific filename to download
-    char target_path[MAX_PATH]; // Alternative target path
+    char files_from[MAX_PATH];    // List of the photos to download, empty for none
+    char target_paths[MAX_TARGETS][MAX_PATH];  // Target paths, the first is the primary one
+    int target_count;
+    struct camera_address cameras[MAX_CAMERAS];  // Cameras to import from
+    int camera_count;
+#ifdef WITH_BENCH
+    char bench_listing[MAX_PATH]; // Recorded listing to benchmark against, empty when not benchmarking
+#endif
+#ifdef WITH_TRACE
+    char trace_file[MAX_PATH];    // Where to write the trace, empty for no trace
+#endif
+    int jobs;                     // Number of concurrent downloads
+    int jobs_set;                 // -j was given
+    int adaptive;                 // Find the number of concurrent downloads per camera, up to jobs
+    int retries;                  // Retries per file after a transient failure
+    double retry_delay;           // Initial backoff in seconds, doubled on each retry
+    long stall_speed;             // Stall threshold in bytes per second
+    long stall_time;              // Seconds below the stall threshold before aborting
+    int use_index;                // Consult and update the import index
+    int incremental;              // Only consider photos above the import watermark
+    int order;                    // enum order_policy
+    int layout;                   // enum folder_layout
+    int watch;                    // Keep running and import whenever the camera shows up
+    long watch_interval;          // Seconds between reachability probes
+    char priority_file[MAX_PATH]; // List of photos to fetch first, empty for none
+    char metrics_file[MAX_PATH];  // Where to write the run metrics, empty for none
+    int metrics_format;           // enum metrics_format
+    int progress;                 // enum progress_mode
+    long write_buffer_kb;         // Write buffer per transfer in KB
+    int direct;                   // Bypass the page cache for new files
+    int verify;                   // Hash downloads, repair short files and drop duplicates
+    long sync_mb;                 // fdatasync every this many MB, 0 to leave it to the kernel
+    long write_pool_mb;           // Receive buffers handed to the writer threads, 0 to write in the callback
+    int durable;                  // Publish completed files only once a batch of them is synced
+    long commit_files;            // Files per durable batch
+    long commit_seconds;          // Longest a completed file waits for its batch
+    char post_commands[MAX_POST_COMMANDS][MAX_FILEPATH];  // Hooks run for every imported file
+    int post_command_count;
+    char post_copy[MAX_PATH];     // Backup directory every imported file is copied to, empty for none
+    int post_jobs;                // Post-processing worker threads
+    const char* preview;          // Fetch this size variant into the preview cache, NULL for a full import
+    char preview_dir[MAX_PATH];   // Preview cache, empty for PREVIEW_DIRNAME below the target
+    long preview_cache_mb;        // Size cap of the preview cache, 0 for none
+    int plan;                     // Only work out what an import would do, writing nothing
+    char plan_json[MAX_PATH];     // Where to write the plan as JSON, empty for the printed summary only
     int help;
 };
 
+// Formats of the per-run metrics file
+enum metrics_format {
+    METRICS_AUTO = 0,     // Prometheus for a .prom file, JSON otherwise
+    METRICS_JSON,
+    METRICS_PROMETHEUS    // Text exposition format, for the node exporter textfile collector
+};
+
+// Long-only option identifiers
+enum {
+    OPT_RETRY_DELAY = 256,
+    OPT_STALL_SPEED,
+    OPT_STALL_TIME,
+    OPT_NO_INDEX,
+    OPT_INCREMENTAL,
+    OPT_URL,
+    OPT_CAMERA,
+    OPT_PROGRESS,
+    OPT_WRITE_BUFFER,
+    OPT_DIRECT,
+    OPT_VERIFY,
+    OPT_SYNC_MB,
+    OPT_WRITE_POOL,
+    OPT_DURABLE,
+    OPT_COMMIT_FILES,
+    OPT_COMMIT_SECONDS,
+    OPT_ORDER,
+    OPT_PRIORITY,
+    OPT_METRICS,
+    OPT_LAYOUT,
+    OPT_WATCH,
+    OPT_WATCH_INTERVAL,
+    OPT_METRICS_FORMAT,
+    OPT_POST_EXEC,
+    OPT_POST_COPY,
+    OPT_POST_JOBS,
+    OPT_PREVIEW,
+    OPT_ADAPTIVE,
+    OPT_PREVIEW_SIZE,
+    OPT_PREVIEW_DIR,
+    OPT_PREVIEW_CACHE,
+    OPT_PLAN,
+    OPT_PLAN_JSON,
+    OPT_FILES_FROM,
+    OPT_BENCH,
+    OPT_TRACE
+};
+
 // Function prototypes
 void sanitize_filename(char* filename);
 int validate_path(const char* path);
+int objs_parser_feed(struct objs_parser* p, const char* data, size_t len);
+double now_seconds(void);
+int transfer_flush(struct transfer* xfer, int final);
+int transfer_reserve(struct transfer* xfer, size_t len);
+int output_append(struct transfer* xfer, int t, const char* data, size_t len);
+void transfer_preallocate(struct transfer* xfer, curl_off_t length);
+const char* photo_name(const struct photo_list* list, const struct photo* p);
+const char* photo_tag(const struct photo_list* list, const struct photo* p);
+uint64_t photo_taken(const struct photo* p);
+void xxh64_update(struct xxh64* state, const void* data, size_t len);
+int listing_buffer_append(struct listing_buffer* buf, const void* data, size_t len);
+void listing_cache_check(struct listing* listing);
+int name_set_contains(const struct name_set* set, const char* tag, const char* name);
 
 // Function to display help
 void show_help(const char* program_name) {
@@ -58,13 +777,146 @@ void show_help(const char* program_name) {
     printf("  -h, --help            Show this help message\n");
     printf("  -f, --format FORMAT   File format to download (dng, jpg, all) [default: all]\n");
     printf("  -F, --file FILENAME   Download only specified file\n");
+    printf("      --files-from FILE Download only the photos named in FILE, one NAME or TAG/NAME per line\n");
     printf("  -p, --path PATH       Alternative target path [default: $HOME/Pictures/RicohGRII]\n");
+    printf("                        Repeat to write every photo to up to %d paths from one download\n", MAX_TARGETS);
+    printf("  -j, --jobs N          Number of concurrent downloads (1-%d) [default: 1]\n", MAX_JOBS);
+    printf("      --adaptive        Tune the concurrent downloads per camera from throughput and time to\n");
+    printf("                        first byte, up to -j [default ceiling: %d]\n", ADAPT_MAX_JOBS);
+    printf("  -r, --retries N       Retries per file after a transient failure [default: 3]\n");
+    printf("      --retry-delay S   Initial retry backoff in seconds, doubled each time [default: 1]\n");
+    printf("      --stall-speed B   Treat a transfer below B bytes/s as stalled [default: 1024]\n");
+    printf("      --stall-time S    Abort a transfer stalled for S seconds [default: 15]\n");
+    printf("      --no-index        Ignore the import index and only check for files on disk\n");
+    printf("      --verify          Hash downloads into the index, resume truncated files, drop duplicates\n");
+    printf("      --incremental     Only consider photos newer than the last import\n");
+    printf("      --watch           Stay running and import new photos whenever the camera appears\n");
+    printf("      --watch-interval S  Seconds between camera probes in watch mode [default: 5]\n");
+    printf("      --layout LAYOUT   Date folders (YYYY-MM-DD, YYYY/MM/DD, YYYY/MM) [default: YYYY-MM-DD]\n");
+    printf("      --order POLICY    Download order (listing, newest, jpg-first, smallest) [default: listing]\n");
+    printf("      --priority FILE   Fetch the photos named in FILE first, one NAME or TAG/NAME per line\n");
+    printf("      --metrics FILE    Write per-run metrics to FILE\n");
+    printf("      --metrics-format F  Metrics format (json, prometheus) [default: prometheus for *.prom, else json]\n");
+    printf("      --url URL         Camera address [default: %s]\n", DEFAULT_URL);
+    printf("      --camera URL[=LABEL]  Import from this camera too, may be repeated (up to %d).\n", MAX_CAMERAS);
+    printf("                        File names and index entries get the label, the host by default\n");
+    printf("      --progress MODE   Progress display (auto, bar, lines, none) [default: auto]\n");
+    printf("      --write-buffer KB Write buffer per transfer [default: %d]\n", DEFAULT_WRITE_BUFFER / 1024);
+    printf("      --direct          Write new files with O_DIRECT, bypassing the page cache\n");
+    printf("      --sync-mb N       Flush each file to the device every N MB [default: 0, off]\n");
+    printf("      --write-pool MB   Write on background threads from a pool of MB of receive buffers,\n");
+    printf("                        pausing downloads only while the pool is used up [default: 0, off]\n");
+    printf("      --durable         Keep completed files under temporary names and publish them in batches,\n");
+    printf("                        with one sync per target, before they are reported and indexed\n");
+    printf("      --commit-files N  Files per durable batch (1-%d), implies --durable [default: %d]\n",
+           MAX_COMMIT_FILES, DEFAULT_COMMIT_FILES);
+    printf("      --commit-seconds S  Commit a durable batch after S seconds even when not full, implies --durable\n");
+    printf("                        [default: %d]\n", DEFAULT_COMMIT_SECONDS);
+    printf("      --post-exec CMD   Run CMD through sh for every imported file, with the file on stdin and\n");
+    printf("                        its path in $1 and RGR2_FILE; may be repeated (up to %d)\n", MAX_POST_COMMANDS);
+    printf("      --post-copy DIR   Copy every imported file into the same folders below DIR\n");
+    printf("      --post-jobs N     Post-processing threads (1-%d) [default: %d]\n", MAX_JOBS, DEFAULT_POST_JOBS);
+    printf("      --preview         Fetch reduced-size previews into the preview cache instead of the photos\n");
+    printf("      --preview-size S  Preview variant (view, thumb), implies --preview [default: view]\n");
+    printf("      --preview-dir DIR Preview cache [default: PATH/%s]\n", PREVIEW_DIRNAME);
+    printf("      --preview-cache-mb N  Evict the least recently used previews above N MB, 0 for no cap [default: %d]\n",
+           DEFAULT_PREVIEW_CACHE_MB);
+    printf("      --plan            Show what an import would transfer and how long it would take, writing nothing\n");
+    printf("      --plan-json FILE  Write the plan with every file to FILE as JSON, implies --plan\n");
+#ifdef WITH_BENCH
+    printf("      --bench LISTING   Benchmark against a local mock camera serving a recorded listing\n");
+#endif
+#ifdef WITH_TRACE
+    printf("      --trace FILE      Record timing spans of the run into FILE as Chrome trace-event JSON\n");
+#endif
     printf("\nExamples:\n");
     printf("  %s                    Download all photos\n", program_name);
     printf("  %s -f jpg            Download only JPG files\n", program_name);
     printf("  %s -f dng            Download only DNG files\n", program_name);
     printf("  %s -F R0001234.JPG   Download specific file\n", program_name);
     printf("  %s -p /media/usb     Download to USB drive\n", program_name);
+    printf("  %s -p /ssd -p /media/usb  Download to an SSD with a copy on a USB drive\n", program_name);
+    printf("  %s -j 3              Download three files at a time\n", program_name);
+}
+
+// Function to parse an integer option value within [min, max]
+int parse_long_option(const char* arg, long min, long max, long* value) {
+    char* end;
+    errno = 0;
+    long v = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || errno != 0 || v < min || v > max) {
+        return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+// Characters allowed in file names and tags: alphanumerics, dots, hyphens and underscores
+static const unsigned char name_char[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0x00
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0x10
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0,  // 0x20  - .
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,  // 0x30  0-9
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x40  A-O
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,  // 0x50  P-Z _
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x60  a-o
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0   // 0x70  p-z
+};
+
+// Function to check that a camera label only uses characters that are safe in file names
+int valid_label(const char* label) {
+    size_t len = strlen(label);
+    if (len == 0 || len >= MAX_LABEL) {
+        return 0;
+    }
+    for (const unsigned char* c = (const unsigned char*)label; *c; c++) {
+        if (!name_char[*c]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to parse a camera address, "URL" or with allow_label "URL=LABEL"
+int parse_camera(const char* arg, int allow_label, struct camera_address* camera) {
+    const char* scheme_end = strstr(arg, "://");
+    const char* label = allow_label && scheme_end ? strchr(scheme_end, '=') : NULL;
+    size_t len = label ? (size_t)(label - arg) : strlen(arg);
+    
+    while (len > 0 && arg[len - 1] == '/') {
+        len--;
+    }
+    if ((strncmp(arg, "http://", 7) != 0 && strncmp(arg, "https://", 8) != 0) ||
+        len >= sizeof(camera->url) - 32) {
+        fprintf(stderr, "Error: Invalid camera URL '%s'\n", arg);
+        return -1;
+    }
+    memcpy(camera->url, arg, len);
+    camera->url[len] = '\0';
+    
+    camera->label[0] = '\0';
+    if (label) {
+        if (!valid_label(label + 1)) {
+            fprintf(stderr, "Error: Invalid camera label '%s'. Use up to %d of A-Z a-z 0-9 . _ -\n",
+                    label + 1, MAX_LABEL - 1);
+            return -1;
+        }
+        strcpy(camera->label, label + 1);
+    }
+    return 0;
+}
+
+// Function to label a camera after its host and port, for cameras given without a label
+void camera_default_label(struct camera_address* camera) {
+    const char* host = strstr(camera->url, "://") + 3;
+    size_t len = 0;
+    
+    while (host[len] && host[len] != '/' && len < MAX_LABEL - 1) {
+        unsigned char c = (unsigned char)host[len];
+        camera->label[len] = name_char[c] ? (char)c : '_';
+        len++;
+    }
+    camera->label[len] = '\0';
 }
 
 // Function to parse command line arguments
@@ -75,18 +927,101 @@ int parse_arguments(int argc, char* argv[], struct cli_options* options) {
     // Initialize default values
     strcpy(options->format, "all");
     options->filename[0] = '\0';
-    options->target_path[0] = '\0';  // Empty means use default
+    options->files_from[0] = '\0';
+    options->target_count = 0;  // None means use default
+    options->camera_count = 0;
+#ifdef WITH_BENCH
+    options->bench_listing[0] = '\0';
+#endif
+#ifdef WITH_TRACE
+    options->trace_file[0] = '\0';
+#endif
+    options->jobs = 1;
+    options->jobs_set = 0;
+    options->adaptive = 0;
+    options->retries = 3;
+    options->retry_delay = 1.0;
+    options->stall_speed = 1024;
+    options->stall_time = 15;
+    options->use_index = 1;
+    options->incremental = 0;
+    options->order = ORDER_LISTING;
+    options->layout = LAYOUT_DAY;
+    options->watch = 0;
+    options->watch_interval = 5;
+    options->priority_file[0] = '\0';
+    options->metrics_file[0] = '\0';
+    options->metrics_format = METRICS_AUTO;
+    options->progress = PROGRESS_AUTO;
+    options->write_buffer_kb = DEFAULT_WRITE_BUFFER / 1024;
+    options->direct = 0;
+    options->verify = 0;
+    options->sync_mb = 0;
+    options->write_pool_mb = 0;
+    options->durable = 0;
+    options->commit_files = DEFAULT_COMMIT_FILES;
+    options->commit_seconds = DEFAULT_COMMIT_SECONDS;
+    options->post_command_count = 0;
+    options->post_copy[0] = '\0';
+    options->post_jobs = DEFAULT_POST_JOBS;
+    options->preview = NULL;
+    options->preview_dir[0] = '\0';
+    options->preview_cache_mb = DEFAULT_PREVIEW_CACHE_MB;
+    options->plan = 0;
+    options->plan_json[0] = '\0';
     options->help = 0;
     
     static struct option long_options[] = {
         {"help",    no_argument,       0, 'h'},
         {"format",  required_argument, 0, 'f'},
         {"file",    required_argument, 0, 'F'},
+        {"files-from",  required_argument, 0, OPT_FILES_FROM},
         {"path",    required_argument, 0, 'p'},
+        {"jobs",    required_argument, 0, 'j'},
+        {"retries", required_argument, 0, 'r'},
+        {"retry-delay", required_argument, 0, OPT_RETRY_DELAY},
+        {"stall-speed", required_argument, 0, OPT_STALL_SPEED},
+        {"stall-time",  required_argument, 0, OPT_STALL_TIME},
+        {"no-index",    no_argument,       0, OPT_NO_INDEX},
+        {"incremental", no_argument,       0, OPT_INCREMENTAL},
+        {"layout",      required_argument, 0, OPT_LAYOUT},
+        {"watch",       no_argument,       0, OPT_WATCH},
+        {"watch-interval", required_argument, 0, OPT_WATCH_INTERVAL},
+        {"order",       required_argument, 0, OPT_ORDER},
+        {"priority",    required_argument, 0, OPT_PRIORITY},
+        {"metrics",     required_argument, 0, OPT_METRICS},
+        {"metrics-format", required_argument, 0, OPT_METRICS_FORMAT},
+        {"url",         required_argument, 0, OPT_URL},
+        {"camera",      required_argument, 0, OPT_CAMERA},
+        {"progress",    required_argument, 0, OPT_PROGRESS},
+        {"write-buffer", required_argument, 0, OPT_WRITE_BUFFER},
+        {"direct",      no_argument,       0, OPT_DIRECT},
+        {"verify",      no_argument,       0, OPT_VERIFY},
+        {"sync-mb",     required_argument, 0, OPT_SYNC_MB},
+        {"write-pool",  required_argument, 0, OPT_WRITE_POOL},
+        {"durable",     no_argument,       0, OPT_DURABLE},
+        {"commit-files", required_argument, 0, OPT_COMMIT_FILES},
+        {"commit-seconds", required_argument, 0, OPT_COMMIT_SECONDS},
+        {"post-exec",   required_argument, 0, OPT_POST_EXEC},
+        {"post-copy",   required_argument, 0, OPT_POST_COPY},
+        {"post-jobs",   required_argument, 0, OPT_POST_JOBS},
+        {"preview",     no_argument,       0, OPT_PREVIEW},
+        {"adaptive",    no_argument,       0, OPT_ADAPTIVE},
+        {"preview-size", required_argument, 0, OPT_PREVIEW_SIZE},
+        {"preview-dir", required_argument, 0, OPT_PREVIEW_DIR},
+        {"preview-cache-mb", required_argument, 0, OPT_PREVIEW_CACHE},
+        {"plan",        no_argument,       0, OPT_PLAN},
+        {"plan-json",   required_argument, 0, OPT_PLAN_JSON},
+#ifdef WITH_BENCH
+        {"bench",       required_argument, 0, OPT_BENCH},
+#endif
+#ifdef WITH_TRACE
+        {"trace",       required_argument, 0, OPT_TRACE},
+#endif
         {0, 0, 0, 0}
     };
     
-    while ((c = getopt_long(argc, argv, "hf:F:p:", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "hf:F:p:j:r:", long_options, &option_index)) != -1) {
         switch (c) {
             case 'h':
                 options->help = 1;
@@ -108,14 +1043,285 @@ int parse_arguments(int argc, char* argv[], struct cli_options* options) {
                     return -1;
                 }
                 break;
-            case 'p':
-                strncpy(options->target_path, optarg, sizeof(options->target_path) - 1);
-                options->target_path[sizeof(options->target_path) - 1] = '\0';
-                if (validate_path(options->target_path) != 0) {
+            case 'p': {
+                if (options->target_count >= MAX_TARGETS) {
+                    fprintf(stderr, "Error: At most %d target paths are supported\n", MAX_TARGETS);
+                    return -1;
+                }
+                char* target = options->target_paths[options->target_count];
+                strncpy(target, optarg, MAX_PATH - 1);
+                target[MAX_PATH - 1] = '\0';
+                if (validate_path(target) != 0) {
                     fprintf(stderr, "Error: Invalid path '%s'\n", optarg);
                     return -1;
                 }
+                options->target_count++;
+                break;
+            }
+            case 'j': {
+                long jobs;
+                if (parse_long_option(optarg, 1, MAX_JOBS, &jobs) != 0) {
+                    fprintf(stderr, "Error: Invalid number of jobs '%s'. Use 1-%d\n", optarg, MAX_JOBS);
+                    return -1;
+                }
+                options->jobs = (int)jobs;
+                options->jobs_set = 1;
+                break;
+            }
+            case 'r': {
+                long retries;
+                if (parse_long_option(optarg, 0, 100, &retries) != 0) {
+                    fprintf(stderr, "Error: Invalid number of retries '%s'. Use 0-100\n", optarg);
+                    return -1;
+                }
+                options->retries = (int)retries;
+                break;
+            }
+            case OPT_RETRY_DELAY: {
+                char* end;
+                double delay = strtod(optarg, &end);
+                if (*optarg == '\0' || *end != '\0' || delay < 0 || delay > MAX_RETRY_DELAY) {
+                    fprintf(stderr, "Error: Invalid retry delay '%s'. Use 0-%.0f seconds\n", optarg, MAX_RETRY_DELAY);
+                    return -1;
+                }
+                options->retry_delay = delay;
+                break;
+            }
+            case OPT_STALL_SPEED:
+                if (parse_long_option(optarg, 1, 1L << 30, &options->stall_speed) != 0) {
+                    fprintf(stderr, "Error: Invalid stall speed '%s'\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_STALL_TIME:
+                if (parse_long_option(optarg, 1, 3600, &options->stall_time) != 0) {
+                    fprintf(stderr, "Error: Invalid stall time '%s'. Use 1-3600 seconds\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_NO_INDEX:
+                options->use_index = 0;
+                break;
+            case OPT_INCREMENTAL:
+                options->incremental = 1;
+                break;
+            case OPT_WATCH:
+                options->watch = 1;
+                break;
+            case OPT_WATCH_INTERVAL:
+                if (parse_long_option(optarg, 1, 3600, &options->watch_interval) != 0) {
+                    fprintf(stderr, "Error: Invalid watch interval '%s'. Use 1-3600 seconds\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_LAYOUT:
+                if (strcmp(optarg, "YYYY-MM-DD") == 0) {
+                    options->layout = LAYOUT_DAY;
+                } else if (strcmp(optarg, "YYYY/MM/DD") == 0) {
+                    options->layout = LAYOUT_NESTED;
+                } else if (strcmp(optarg, "YYYY/MM") == 0) {
+                    options->layout = LAYOUT_MONTH;
+                } else {
+                    fprintf(stderr, "Error: Invalid layout '%s'. Use 'YYYY-MM-DD', 'YYYY/MM/DD', or 'YYYY/MM'\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_ORDER:
+                if (strcmp(optarg, "listing") == 0) {
+                    options->order = ORDER_LISTING;
+                } else if (strcmp(optarg, "newest") == 0) {
+                    options->order = ORDER_NEWEST;
+                } else if (strcmp(optarg, "jpg-first") == 0) {
+                    options->order = ORDER_JPG_FIRST;
+                } else if (strcmp(optarg, "smallest") == 0) {
+                    options->order = ORDER_SMALLEST;
+                } else {
+                    fprintf(stderr, "Error: Invalid order '%s'. Use 'listing', 'newest', 'jpg-first', or 'smallest'\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_FILES_FROM:
+                strncpy(options->files_from, optarg, sizeof(options->files_from) - 1);
+                options->files_from[sizeof(options->files_from) - 1] = '\0';
+                break;
+            case OPT_PRIORITY:
+                strncpy(options->priority_file, optarg, sizeof(options->priority_file) - 1);
+                options->priority_file[sizeof(options->priority_file) - 1] = '\0';
+                break;
+            case OPT_METRICS:
+                strncpy(options->metrics_file, optarg, sizeof(options->metrics_file) - 1);
+                options->metrics_file[sizeof(options->metrics_file) - 1] = '\0';
+                break;
+            case OPT_METRICS_FORMAT:
+                if (strcmp(optarg, "json") == 0) {
+                    options->metrics_format = METRICS_JSON;
+                } else if (strcmp(optarg, "prometheus") == 0) {
+                    options->metrics_format = METRICS_PROMETHEUS;
+                } else {
+                    fprintf(stderr, "Error: Invalid metrics format '%s'. Use 'json' or 'prometheus'\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_URL:
+            case OPT_CAMERA:
+                if (options->camera_count >= MAX_CAMERAS) {
+                    fprintf(stderr, "Error: At most %d cameras are supported\n", MAX_CAMERAS);
+                    return -1;
+                }
+                if (parse_camera(optarg, c == OPT_CAMERA, &options->cameras[options->camera_count]) != 0) {
+                    return -1;
+                }
+                options->camera_count++;
+                break;
+            case OPT_PROGRESS:
+                if (strcmp(optarg, "auto") == 0) {
+                    options->progress = PROGRESS_AUTO;
+                } else if (strcmp(optarg, "bar") == 0) {
+                    options->progress = PROGRESS_BAR;
+                } else if (strcmp(optarg, "lines") == 0) {
+                    options->progress = PROGRESS_LINES;
+                } else if (strcmp(optarg, "none") == 0) {
+                    options->progress = PROGRESS_NONE;
+                } else {
+                    fprintf(stderr, "Error: Invalid progress mode '%s'. Use 'auto', 'bar', 'lines', or 'none'\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_WRITE_BUFFER:
+                if (parse_long_option(optarg, WRITE_ALIGN / 1024, MAX_WRITE_BUFFER / 1024, &options->write_buffer_kb) != 0) {
+                    fprintf(stderr, "Error: Invalid write buffer '%s'. Use %d-%d KB\n", optarg,
+                            WRITE_ALIGN / 1024, MAX_WRITE_BUFFER / 1024);
+                    return -1;
+                }
+                break;
+            case OPT_DIRECT:
+                options->direct = 1;
+                break;
+            case OPT_VERIFY:
+                options->verify = 1;
+                break;
+            case OPT_SYNC_MB:
+                if (parse_long_option(optarg, 0, 65536, &options->sync_mb) != 0) {
+                    fprintf(stderr, "Error: Invalid sync interval '%s'\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_WRITE_POOL:
+                if (parse_long_option(optarg, 0, 65536, &options->write_pool_mb) != 0) {
+                    fprintf(stderr, "Error: Invalid write pool size '%s'\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_DURABLE:
+                options->durable = 1;
+                break;
+            case OPT_COMMIT_FILES:
+                if (parse_long_option(optarg, 1, MAX_COMMIT_FILES, &options->commit_files) != 0) {
+                    fprintf(stderr, "Error: Invalid batch size '%s'. Use 1-%d files\n", optarg, MAX_COMMIT_FILES);
+                    return -1;
+                }
+                options->durable = 1;
+                break;
+            case OPT_COMMIT_SECONDS:
+                if (parse_long_option(optarg, 1, 3600, &options->commit_seconds) != 0) {
+                    fprintf(stderr, "Error: Invalid commit interval '%s'\n", optarg);
+                    return -1;
+                }
+                options->durable = 1;
+                break;
+            case OPT_POST_EXEC:
+                if (options->post_command_count >= MAX_POST_COMMANDS) {
+                    fprintf(stderr, "Error: At most %d post-processing commands are supported\n", MAX_POST_COMMANDS);
+                    return -1;
+                }
+                if (strlen(optarg) >= sizeof(options->post_commands[0])) {
+                    fprintf(stderr, "Error: Post-processing command too long\n");
+                    return -1;
+                }
+                strcpy(options->post_commands[options->post_command_count++], optarg);
+                break;
+            case OPT_POST_COPY: {
+                strncpy(options->post_copy, optarg, sizeof(options->post_copy) - 1);
+                options->post_copy[sizeof(options->post_copy) - 1] = '\0';
+                if (validate_path(options->post_copy) != 0) {
+                    fprintf(stderr, "Error: Invalid backup path '%s'\n", optarg);
+                    return -1;
+                }
+                size_t len = strlen(options->post_copy);
+                while (len > 1 && options->post_copy[len - 1] == '/') {
+                    options->post_copy[--len] = '\0';
+                }
+                break;
+            }
+            case OPT_POST_JOBS: {
+                long jobs;
+                if (parse_long_option(optarg, 1, MAX_JOBS, &jobs) != 0) {
+                    fprintf(stderr, "Error: Invalid number of post-processing jobs '%s'. Use 1-%d\n", optarg, MAX_JOBS);
+                    return -1;
+                }
+                options->post_jobs = (int)jobs;
+                break;
+            }
+            case OPT_ADAPTIVE:
+                options->adaptive = 1;
+                break;
+            case OPT_PREVIEW:
+                if (!options->preview) {
+                    options->preview = "view";
+                }
+                break;
+            case OPT_PREVIEW_SIZE:
+                if (strcmp(optarg, "view") == 0) {
+                    options->preview = "view";
+                } else if (strcmp(optarg, "thumb") == 0) {
+                    options->preview = "thumb";
+                } else {
+                    fprintf(stderr, "Error: Invalid preview size '%s'. Use 'view' or 'thumb'\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_PREVIEW_DIR: {
+                strncpy(options->preview_dir, optarg, sizeof(options->preview_dir) - 1);
+                options->preview_dir[sizeof(options->preview_dir) - 1] = '\0';
+                if (validate_path(options->preview_dir) != 0) {
+                    fprintf(stderr, "Error: Invalid preview path '%s'\n", optarg);
+                    return -1;
+                }
+                size_t len = strlen(options->preview_dir);
+                while (len > 1 && options->preview_dir[len - 1] == '/') {
+                    options->preview_dir[--len] = '\0';
+                }
+                break;
+            }
+            case OPT_PREVIEW_CACHE:
+                if (parse_long_option(optarg, 0, 1L << 20, &options->preview_cache_mb) != 0) {
+                    fprintf(stderr, "Error: Invalid preview cache size '%s'\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_PLAN:
+                options->plan = 1;
+                break;
+            case OPT_PLAN_JSON:
+                if (strlen(optarg) >= sizeof(options->plan_json)) {
+                    fprintf(stderr, "Error: Plan file path too long\n");
+                    return -1;
+                }
+                strcpy(options->plan_json, optarg);
+                options->plan = 1;
+                break;
+#ifdef WITH_BENCH
+            case OPT_BENCH:
+                strncpy(options->bench_listing, optarg, sizeof(options->bench_listing) - 1);
+                options->bench_listing[sizeof(options->bench_listing) - 1] = '\0';
+                break;
+#endif
+#ifdef WITH_TRACE
+            case OPT_TRACE:
+                strncpy(options->trace_file, optarg, sizeof(options->trace_file) - 1);
+                options->trace_file[sizeof(options->trace_file) - 1] = '\0';
                 break;
+#endif
             case '?':
                 return -1;
             default:
@@ -123,6 +1329,44 @@ int parse_arguments(int argc, char* argv[], struct cli_options* options) {
         }
     }
     
+    // Without -j the adaptive controller may go up to a ceiling that suits the camera's server
+    if (options->adaptive && !options->jobs_set) {
+        options->jobs = ADAPT_MAX_JOBS;
+    }
+    
+    // A preview run only fills the cache, the import extras act on full photos
+    if (options->preview && (options->target_count > 1 || options->post_command_count > 0 ||
+                             options->post_copy[0] != '\0' || options->verify)) {
+        fprintf(stderr, "Error: --preview cannot be combined with several -p, --post-exec, --post-copy or --verify\n");
+        return -1;
+    }
+    
+    // A plan looks at one import, it neither waits for the camera nor fetches previews
+    if (options->plan && (options->watch || options->preview)) {
+        fprintf(stderr, "Error: --plan cannot be combined with --watch or --preview\n");
+        return -1;
+    }
+    
+    if (options->camera_count == 0) {
+        strcpy(options->cameras[0].url, DEFAULT_URL);
+        options->cameras[0].label[0] = '\0';
+        options->camera_count = 1;
+    }
+    
+    // Photos of several cameras share folders, so each camera needs a distinct label
+    for (int i = 0; options->camera_count > 1 && i < options->camera_count; i++) {
+        if (options->cameras[i].label[0] == '\0') {
+            camera_default_label(&options->cameras[i]);
+        }
+        for (int j = 0; j < i; j++) {
+            if (strcmp(options->cameras[i].label, options->cameras[j].label) == 0) {
+                fprintf(stderr, "Error: Cameras %s and %s share the label '%s'\n",
+                        options->cameras[j].url, options->cameras[i].url, options->cameras[i].label);
+                return -1;
+            }
+        }
+    }
+    
     return 0;
 }
 
@@ -147,299 +1391,5444 @@ int matches_format(const char* filename, const char* format) {
     return 0;
 }
 
-// Callback function to write received data into our buffer
-static size_t write_callback(void* contents, size_t size, size_t nmemb, struct http_response* response) {
+// Callback function to feed received listing data straight into the streaming parser
+static size_t write_callback(void* contents, size_t size, size_t nmemb, struct listing* listing) {
     size_t realsize = size * nmemb;
-    char* ptr = realloc(response->data, response->size + realsize + 1);
+    struct listing_cache* cache = &listing->cache;
     
-    if (ptr == NULL) {
-        printf("Not enough memory (realloc returned NULL)\n");
+    // Returning less than realsize aborts the transfer. The raw body goes into the listing cache.
+    if (!cache->checked) {
+        listing_cache_check(listing);
+    }
+    if (listing_buffer_append(&cache->body, contents, realsize) != 0) {
         return 0;
     }
+    xxh64_update(&cache->hash, contents, realsize);
+    if (cache->deferred) {
+        return realsize;
+    }
     
-    response->data = ptr;
-    memcpy(&(response->data[response->size]), contents, realsize);
-    response->size += realsize;
-    response->data[response->size] = 0; // Null terminate
+    double started = now_seconds();
+    int rc = objs_parser_feed(&listing->parser, contents, realsize);
+    double finished = now_seconds();
+    listing->parse_seconds += finished - started;
+    TRACE_SPAN("parse", NULL, listing->track, started, finished);
+    if (rc != 0) {
+        return 0;
+    }
     
+    // Hold the listing back while the downloads work through what is already queued.
+    // A scheduled order needs the whole listing first, so it is never held back.
+    if (!listing->paused && !listing->list.ordered &&
+        listing->list.count - listing->list.next >= MAX_QUEUED_PHOTOS) {
+        listing->paused = 1;
+        curl_easy_pause(listing->curl, CURLPAUSE_RECV);
+    }
+    return realsize;
+}
+
+// Callback function to write downloaded photo data to its partial file
+static size_t file_write_callback(void* contents, size_t size, size_t nmemb, struct transfer* xfer) {
+    size_t realsize = size * nmemb;
+    
+    // With the write pool the network is held back only while no block is free; curl hands the same data over again
+    if (xfer->session->pool) {
+        int rc = transfer_reserve(xfer, realsize);
+        if (rc < 0) {
+            return 0;
+        }
+        if (rc == 0) {
+            xfer->paused = 1;
+            xfer->paused_at = now_seconds();
+            xfer->session->pool->pauses++;
+            return CURL_WRITEFUNC_PAUSE;
+        }
+    }
+    
+    // Remember when the very first photo byte of the run arrived
+    if (xfer->session->first_byte == 0) {
+        xfer->session->first_byte = now_seconds();
+    }
+    
+    // Reserve the whole file up front so slow removable media get one contiguous extent
+    if (!xfer->out[0].preallocated) {
+        curl_off_t length = -1;
+        xfer->out[0].preallocated = 1;
+        if (curl_easy_getinfo(xfer->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) == CURLE_OK && length > 0) {
+            transfer_preallocate(xfer, length);
+        }
+    }
+    
+    // Collect data into large aligned writes instead of writing every chunk curl hands over;
+    // the data of one network read is fanned out to the buffer of every target
+    xfer->camera->adapt.bytes += realsize;
+    if (xfer->hashing) {
+        xxh64_update(&xfer->hash, contents, realsize);
+    }
+    for (int t = 0; t < xfer->session->target_count; t++) {
+        if (output_append(xfer, t, contents, realsize) != 0) {
+            return 0;
+        }
+    }
     return realsize;
 }
 
-// Progress callback function
-static int progress_callback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, 
-                           curl_off_t ultotal __attribute__((unused)), 
-                           curl_off_t ulnow __attribute__((unused))) {
-    struct progress_data* progress = (struct progress_data*)clientp;
+// Function to create directory if it doesn't exist
+int create_directory(const char* path) {
+    // A single mkdir both creates the directory and tells whether it was there already
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to copy a name keeping only safe characters, in a single pass.
+// Returns the length of the result, which is always NUL-terminated.
+size_t sanitize_copy(char* dst, size_t size, const char* src) {
+    size_t len = 0;
+    
+    for (const unsigned char* c = (const unsigned char*)src; *c && len < size - 1; c++) {
+        dst[len] = (char)*c;
+        len += name_char[*c];
+    }
+    dst[len] = '\0';
+    return len;
+}
+
+// Function to sanitize filename by removing dangerous characters
+void sanitize_filename(char* filename) {
+    if (!filename) return;
+    
+    // Safe characters are kept, dangerous ones are skipped
+    sanitize_copy(filename, strlen(filename) + 1, filename);
+}
+
+// Function to validate and sanitize path
+int validate_path(const char* path) {
+    if (!path || strlen(path) == 0) return -1;
+    
+    // Check for path traversal attempts
+    if (strstr(path, "..") != NULL) return -1;
+    if (strstr(path, "//") != NULL) return -1;
+    
+    // Check for null bytes
+    if (strlen(path) != strcspn(path, "\0")) return -1;
+    
+    // Check maximum path length
+    if (strlen(path) >= MAX_PATH) return -1;
+    
+    return 0;
+}
+
+// Function to format a packed YYYYMMDD date as YYYY-MM-DD
+void format_date_folder(uint32_t date, char* date_folder) {
+    snprintf(date_folder, MAX_DATE, "%04u-%02u-%02u", date / 10000, date / 100 % 100, date % 100);
+}
+
+// Function to count the directory levels of a folder layout
+int layout_levels(int layout) {
+    switch (layout) {
+        case LAYOUT_NESTED:
+            return 3;
+        case LAYOUT_MONTH:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// Function to format the folder of a date down to a level of the layout, 1 being the topmost
+void format_layout_folder(uint32_t date, int layout, int level, char* folder) {
+    unsigned year = date / 10000;
+    unsigned month = date / 100 % 100;
+    unsigned day = date % 100;
+    
+    if (layout == LAYOUT_DAY) {
+        snprintf(folder, MAX_DATE, "%04u-%02u-%02u", year, month, day);
+    } else if (level == 1) {
+        snprintf(folder, MAX_DATE, "%04u", year);
+    } else if (level == 2) {
+        snprintf(folder, MAX_DATE, "%04u/%02u", year, month);
+    } else {
+        snprintf(folder, MAX_DATE, "%04u/%02u/%02u", year, month, day);
+    }
+}
+
+// Function to get the current local date packed as YYYYMMDD
+uint32_t current_date(void) {
+    time_t t = time(NULL);
+    struct tm tm_info;
+    localtime_r(&t, &tm_info);
+    return (uint32_t)((tm_info.tm_year + 1900) * 10000 + (tm_info.tm_mon + 1) * 100 + tm_info.tm_mday);
+}
+
+// Function to read exactly count decimal digits. Returns the advanced pointer, or NULL when they are not there.
+static const char* parse_digits(const char* p, int count, int* value) {
+    int v = 0;
+    for (int i = 0; i < count; i++) {
+        unsigned d = (unsigned char)p[i] - '0';
+        if (d > 9) {
+            return NULL;
+        }
+        v = v * 10 + (int)d;
+    }
+    *value = v;
+    return p + count;
+}
+
+// Function to pack a "YYYY-MM-DDTHH:MM:SS" timestamp into a YYYYMMDDhhmmss integer, 0 when unparsable
+uint64_t parse_timestamp(const char* timestamp) {
+    int year, month, day, hour = 0, minute = 0, second = 0;
+    const char* p = timestamp;
+    
+    // The camera writes the fixed ISO form, so this is a handful of comparisons per photo
+    if (!(p = parse_digits(p, 4, &year)) || *p++ != '-' ||
+        !(p = parse_digits(p, 2, &month)) || *p++ != '-' ||
+        !(p = parse_digits(p, 2, &day)) ||
+        month < 1 || month > 12 || day < 1 || day > 31) {
+        return 0;
+    }
+    
+    // The time of day is optional, whatever part of it is present is used
+    if (*p == 'T' &&
+        (p = parse_digits(p + 1, 2, &hour)) && *p == ':' &&
+        (p = parse_digits(p + 1, 2, &minute)) && *p == ':') {
+        parse_digits(p + 1, 2, &second);
+    }
+    return (uint64_t)(year * 10000 + month * 100 + day) * 1000000ULL +
+           (uint64_t)(hour * 10000 + minute * 100 + second);
+}
+
+// Function to order a photo against the watermark: by capture time, then tag, then name.
+// Photos without a capture time are ordered by tag and name only.
+int watermark_compare(uint64_t taken, const char* tag, const char* name, const struct watermark* mark) {
+    if (taken && mark->taken && taken != mark->taken) {
+        return taken < mark->taken ? -1 : 1;
+    }
+    int c = strcmp(tag, mark->tag);
+    if (c == 0) {
+        c = strcmp(name, mark->name);
+    }
+    return c;
+}
+
+// Function to build the watermark file path; each camera and format filter keeps its own mark
+void watermark_path(char* path, size_t size, const char* base_path, const char* label, const char* format) {
+    if (label[0] != '\0') {
+        snprintf(path, size, "%s/%s.%s.%s", base_path, MARK_FILENAME, label, format);
+    } else {
+        snprintf(path, size, "%s/%s.%s", base_path, MARK_FILENAME, format);
+    }
+}
+
+// Function to read a watermark file. Returns 0 when a mark was loaded.
+int watermark_read(const char* path, struct watermark* mark) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    
+    unsigned long long taken;
+    int rc = fscanf(fp, "%llu %255s %255s", &taken, mark->tag, mark->name) == 3 ? 0 : -1;
+    mark->taken = (uint64_t)taken;
+    fclose(fp);
+    if (rc != 0) {
+        fprintf(stderr, "Warning: ignoring malformed watermark %s\n", path);
+    }
+    return rc;
+}
+
+// Function to load the effective watermark for a format; a run over all formats also covers jpg and dng
+int watermark_load(const char* base_path, const char* label, const char* format, struct watermark* mark) {
+    char path[MAX_FILEPATH];
+    struct watermark all;
+    
+    watermark_path(path, sizeof(path), base_path, label, format);
+    int rc = watermark_read(path, mark);
+    if (strcmp(format, "all") != 0) {
+        watermark_path(path, sizeof(path), base_path, label, "all");
+        if (watermark_read(path, &all) == 0 &&
+            (rc != 0 || watermark_compare(all.taken, all.tag, all.name, mark) > 0)) {
+            *mark = all;
+            rc = 0;
+        }
+    }
+    return rc;
+}
+
+// Function to order a photo record against the watermark
+int watermark_compare_photo(const struct photo_list* list, const struct photo* p, const struct watermark* mark) {
+    return watermark_compare(photo_taken(p), photo_tag(list, p), photo_name(list, p), mark);
+}
+
+// Function to set a watermark to the position of a photo
+void watermark_from_photo(struct watermark* mark, const struct photo_list* list, const struct photo* p) {
+    const char* tag = photo_tag(list, p);
+    const char* name = photo_name(list, p);
+    mark->taken = photo_taken(p);
+    memcpy(mark->tag, tag, strlen(tag) + 1);
+    memcpy(mark->name, name, strlen(name) + 1);
+}
+
+// Function to move a watermark through the photos of this run that were imported in capture order.
+// --order and --priority let photos complete out of that order, so the mark only covers the longest
+// capture-order run of imported photos; the lowest photo that failed or was never finished stops it.
+// Returns 1 when the mark moved.
+int watermark_advance(const struct photo_list* list, struct watermark* mark, int have_mark) {
+    const struct photo* photos = list->photos;
+    int photo_count = list->count;
+    struct watermark limit;
+    int have_limit = 0;
+    int moved = 0;
+    
+    // The lowest photo not imported caps how far the mark may move
+    for (int i = 0; i < photo_count; i++) {
+        const struct photo* p = &photos[i];
+        if (p->outcome != OUTCOME_DONE &&
+            (!have_limit || watermark_compare_photo(list, p, &limit) < 0)) {
+            watermark_from_photo(&limit, list, p);
+            have_limit = 1;
+        }
+    }
+    
+    for (int i = 0; i < photo_count; i++) {
+        const struct photo* p = &photos[i];
+        if (p->outcome != OUTCOME_DONE) {
+            continue;
+        }
+        if (have_limit && watermark_compare_photo(list, p, &limit) >= 0) {
+            continue;
+        }
+        if (have_mark && watermark_compare_photo(list, p, mark) <= 0) {
+            continue;
+        }
+        watermark_from_photo(mark, list, p);
+        have_mark = 1;
+        moved = 1;
+    }
+    return moved;
+}
+
+// Function to store a watermark, replacing the previous one atomically
+int watermark_save(const char* base_path, const char* label, const char* format, const struct watermark* mark) {
+    char path[MAX_FILEPATH];
+    char tmp_path[MAX_FILEPATH + 8];
+    
+    watermark_path(path, sizeof(path), base_path, label, format);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    
+    FILE* fp = fopen(tmp_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Warning: cannot write watermark %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "%llu %s %s\n", (unsigned long long)mark->taken, mark->tag, mark->name);
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Warning: cannot update watermark %s\n", path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to hash an index key (FNV-1a over tag, name and packed date)
+uint64_t index_hash(const char* tag, const char* name, uint32_t date) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char* p = tag; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    h = (h ^ '/') * 1099511628211ULL;
+    for (const char* p = name; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    for (int i = 0; i < 4; i++) {
+        h = (h ^ ((date >> (i * 8)) & 0xff)) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Function to find the slot of a key in the index table, or the empty slot where it belongs
+size_t index_find_slot(const struct import_index* index, uint64_t hash, const char* tag, const char* name, uint32_t date) {
+    size_t mask = index->capacity - 1;
+    size_t i = (size_t)hash & mask;
+    
+    while (index->entries[i].key) {
+        const struct index_entry* e = &index->entries[i];
+        if (e->hash == hash && e->date == date && e->tag_len == strlen(tag) &&
+            memcmp(e->key, tag, e->tag_len) == 0 && strcmp(e->key + e->tag_len + 1, name) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Function to find the slot of a content in the content table, or the empty slot where it belongs
+size_t index_content_slot(const struct import_index* index, uint64_t content, uint64_t size) {
+    size_t mask = index->content_capacity - 1;
+    size_t i = (size_t)content & mask;
+    
+    while (index->contents[i].content &&
+           (index->contents[i].content != content || index->contents[i].size != size)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Function to remember the content of an index entry; the first photo with some content keeps it
+int index_add_content(struct import_index* index, const struct index_entry* e) {
+    if ((index->content_count + 1) * 2 > index->content_capacity) {
+        size_t new_capacity = index->content_capacity ? index->content_capacity * 2 : 1024;
+        struct content_entry* contents = calloc(new_capacity, sizeof(struct content_entry));
+        if (!contents) {
+            return -1;
+        }
+        struct content_entry* old = index->contents;
+        size_t old_capacity = index->content_capacity;
+        index->contents = contents;
+        index->content_capacity = new_capacity;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].content) {
+                contents[index_content_slot(index, old[i].content, old[i].size)] = old[i];
+            }
+        }
+        free(old);
+    }
+    
+    struct content_entry* c = &index->contents[index_content_slot(index, e->content, e->size)];
+    if (!c->content) {
+        c->content = e->content;
+        c->size = e->size;
+        c->key = e->key;
+        index->content_count++;
+    }
+    return 0;
+}
+
+// Function to look up an imported photo with the given content. Returns its "tag\0name\0" key or NULL.
+const char* index_find_content(const struct import_index* index, uint64_t content, uint64_t size) {
+    if (index->content_count == 0 || content == 0) {
+        return NULL;
+    }
+    const struct content_entry* c = &index->contents[index_content_slot(index, content, size)];
+    return c->content ? c->key : NULL;
+}
+
+// Function to insert a key into the in-memory index table.
+// Returns 1 for a new key, 2 when the size or content of a known key changed, 0 when unchanged and -1 on error.
+int index_insert(struct import_index* index, const char* tag, const char* name, uint32_t date,
+                 uint64_t size, uint64_t content) {
+    // Keep the load factor below one half
+    if ((index->count + 1) * 2 > index->capacity) {
+        size_t new_capacity = index->capacity ? index->capacity * 2 : 1024;
+        struct index_entry* entries = calloc(new_capacity, sizeof(struct index_entry));
+        if (!entries) {
+            return -1;
+        }
+        for (size_t i = 0; i < index->capacity; i++) {
+            if (index->entries[i].key) {
+                size_t j = (size_t)index->entries[i].hash & (new_capacity - 1);
+                while (entries[j].key) {
+                    j = (j + 1) & (new_capacity - 1);
+                }
+                entries[j] = index->entries[i];
+            }
+        }
+        free(index->entries);
+        index->entries = entries;
+        index->capacity = new_capacity;
+    }
+    
+    uint64_t hash = index_hash(tag, name, date);
+    size_t slot = index_find_slot(index, hash, tag, name, date);
+    struct index_entry* e = &index->entries[slot];
+    if (e->key) {
+        // Already known, keep the most precise size and the latest content
+        if ((size && e->size != size) || (content && e->content != content)) {
+            e->size = size ? size : e->size;
+            e->content = content ? content : e->content;
+            if (e->content && index_add_content(index, e) != 0) {
+                return -1;
+            }
+            return 2;
+        }
+        return 0;
+    }
+    
+    size_t tag_len = strlen(tag);
+    size_t name_len = strlen(name);
+    e->key = malloc(tag_len + name_len + 2);
+    if (!e->key) {
+        return -1;
+    }
+    memcpy(e->key, tag, tag_len);
+    e->key[tag_len] = '\0';
+    memcpy(e->key + tag_len + 1, name, name_len + 1);
+    e->tag_len = (uint8_t)tag_len;
+    e->hash = hash;
+    e->date = date;
+    e->size = size;
+    e->content = content;
+    index->count++;
+    if (content && index_add_content(index, e) != 0) {
+        return -1;
+    }
+    return 1;
+}
+
+// Function to append one record to an index file
+int index_write_record(FILE* fp, const char* tag, const char* name, uint32_t date, uint64_t size, uint64_t content) {
+    struct index_record rec = {0};
+    rec.size = size;
+    rec.content = content;
+    rec.date = date;
+    rec.tag_len = (uint8_t)strlen(tag);
+    rec.name_len = (uint8_t)strlen(name);
+    if (fwrite(&rec, sizeof(rec), 1, fp) != 1 ||
+        fwrite(tag, 1, rec.tag_len, fp) != rec.tag_len ||
+        fwrite(name, 1, rec.name_len, fp) != rec.name_len) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to write the whole index in the current format, replacing the file atomically
+int index_rewrite(const struct import_index* index) {
+    char tmp_path[MAX_FILEPATH + 8];
+    
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index->path);
+    FILE* fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        return -1;
+    }
+    int ok = fwrite(INDEX_MAGIC, 1, sizeof(INDEX_MAGIC) - 1, fp) == sizeof(INDEX_MAGIC) - 1;
+    for (size_t i = 0; ok && i < index->capacity; i++) {
+        const struct index_entry* e = &index->entries[i];
+        if (e->key) {
+            ok = index_write_record(fp, e->key, e->key + e->tag_len + 1, e->date, e->size, e->content) == 0;
+        }
+    }
+    if (fclose(fp) != 0 || !ok || rename(tmp_path, index->path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to load the import index from the target directory and open it for appending.
+// A read-only index is only loaded; the file is neither repaired, upgraded nor created.
+int index_open(struct import_index* index, const char* base_path, int read_only) {
+    char header[sizeof(INDEX_MAGIC) - 1];
+    char tag[MAX_TAG];
+    char name[MAX_FILENAME];
+    struct index_record rec;
+    struct index_record_v1 rec_v1;
+    long good = 0;
+    int legacy = 0;
+    
+    memset(index, 0, sizeof(*index));
+    snprintf(index->path, sizeof(index->path), "%s/%s", base_path, INDEX_FILENAME);
+    
+    FILE* fp = fopen(index->path, "rb");
+    if (fp) {
+        size_t header_len = fread(header, 1, sizeof(header), fp);
+        legacy = header_len == sizeof(header) && memcmp(header, INDEX_MAGIC_V1, sizeof(header)) == 0;
+        if (header_len == sizeof(header) &&
+            (legacy || memcmp(header, INDEX_MAGIC, sizeof(header)) == 0)) {
+            good = (long)sizeof(header);
+            
+            // Read records until the end or a torn record from an interrupted run
+            for (;;) {
+                if (legacy) {
+                    if (fread(&rec_v1, sizeof(rec_v1), 1, fp) != 1) {
+                        break;
+                    }
+                    rec.size = rec_v1.size;
+                    rec.content = 0;
+                    rec.date = rec_v1.date;
+                    rec.tag_len = rec_v1.tag_len;
+                    rec.name_len = rec_v1.name_len;
+                } else if (fread(&rec, sizeof(rec), 1, fp) != 1) {
+                    break;
+                }
+                if (rec.tag_len == 0 || rec.name_len == 0 ||
+                    fread(tag, 1, rec.tag_len, fp) != rec.tag_len ||
+                    fread(name, 1, rec.name_len, fp) != rec.name_len) {
+                    break;
+                }
+                tag[rec.tag_len] = '\0';
+                name[rec.name_len] = '\0';
+                if (index_insert(index, tag, name, rec.date, rec.size, rec.content) < 0) {
+                    fprintf(stderr, "Not enough memory for import index\n");
+                    fclose(fp);
+                    return -1;
+                }
+                good = ftell(fp);
+            }
+        } else {
+            fprintf(stderr, "Warning: ignoring unrecognized import index %s\n", index->path);
+        }
+        fclose(fp);
+    }
+    if (read_only) {
+        return 0;
+    }
+    
+    // An index of the first format is converted once, later records need the content field
+    if (legacy) {
+        if (index_rewrite(index) != 0) {
+            fprintf(stderr, "Warning: cannot upgrade import index %s, leaving it unchanged\n", index->path);
+            return 0;
+        }
+        good = 0;
+        index->log = fopen(index->path, "ab");
+        if (!index->log) {
+            fprintf(stderr, "Warning: cannot write import index %s: %s\n", index->path, strerror(errno));
+        }
+        return 0;
+    }
+    
+    // Drop a torn tail so new records start on a record boundary
+    index->log = fopen(index->path, good > 0 ? "r+b" : "wb");
+    if (!index->log) {
+        fprintf(stderr, "Warning: cannot write import index %s: %s\n", index->path, strerror(errno));
+        return 0;
+    }
+    if (good > 0) {
+        if (ftruncate(fileno(index->log), good) != 0 || fseek(index->log, good, SEEK_SET) != 0) {
+            fprintf(stderr, "Warning: cannot repair import index %s\n", index->path);
+            fclose(index->log);
+            index->log = NULL;
+        }
+    } else if (fwrite(INDEX_MAGIC, 1, sizeof(header), index->log) != sizeof(header)) {
+        fclose(index->log);
+        index->log = NULL;
+    }
+    return 0;
+}
+
+// Function to look up an imported photo. A known size that differs means a different photo reusing
+// the same name, so it does not match. Returns the entry or NULL.
+const struct index_entry* index_find(const struct import_index* index, const char* tag, const char* name,
+                                     uint32_t date, uint64_t size) {
+    if (index->count == 0) {
+        return NULL;
+    }
+    
+    const struct index_entry* e = &index->entries[index_find_slot(index, index_hash(tag, name, date), tag, name, date)];
+    if (!e->key || (size && e->size && size != e->size)) {
+        return NULL;
+    }
+    return e;
+}
+
+// Function to check whether a photo has already been imported
+int index_contains(const struct import_index* index, const char* tag, const char* name, uint32_t date, uint64_t size) {
+    return index_find(index, tag, name, date, size) != NULL;
+}
+
+// Function to append a photo already added in memory to the index log
+void index_log(struct import_index* index, const char* tag, const char* name, uint32_t date,
+               uint64_t size, uint64_t content) {
+    if (!index->log) {
+        return;
+    }
+    if (index_write_record(index->log, tag, name, date, size, content) != 0 ||
+        fflush(index->log) != 0) {
+        fprintf(stderr, "Warning: failed to update import index %s\n", index->path);
+    }
+}
+
+// Function to make the records appended to the index log durable
+void index_sync(struct import_index* index) {
+    if (index->log && fdatasync(fileno(index->log)) != 0) {
+        fprintf(stderr, "Warning: cannot sync import index %s: %s\n", index->path, strerror(errno));
+    }
+}
+
+// Function to record an imported photo in memory and in the on-disk log
+void index_add(struct import_index* index, const char* tag, const char* name, uint32_t date,
+               uint64_t size, uint64_t content) {
+    int rc = index_insert(index, tag, name, date, size, content);
+    if (rc < 0) {
+        fprintf(stderr, "Not enough memory for import index\n");
+        return;
+    }
+    if (rc > 0) {
+        index_log(index, tag, name, date, size, content);
+    }
+}
+
+// Function to release the import index
+void index_close(struct import_index* index) {
+    if (index->log) {
+        fclose(index->log);
+        index->log = NULL;
+    }
+    for (size_t i = 0; i < index->capacity; i++) {
+        free(index->entries[i].key);
+    }
+    free(index->entries);
+    index->entries = NULL;
+    index->capacity = 0;
+    index->count = 0;
+    free(index->contents);
+    index->contents = NULL;
+    index->content_capacity = 0;
+    index->content_count = 0;
+}
+
+// XXH64 constants
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+// Function to rotate a 64-bit value left
+static uint64_t xxh64_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Function to read a little-endian 64-bit value
+static uint64_t xxh64_read64(const unsigned char* p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+// Function to read a little-endian 32-bit value
+static uint64_t xxh64_read32(const unsigned char* p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24;
+}
+
+// Function to mix one input lane into an accumulator
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh64_rotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+// Function to fold an accumulator into the hash
+static uint64_t xxh64_merge(uint64_t hash, uint64_t acc) {
+    hash ^= xxh64_round(0, acc);
+    return hash * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// Function to consume one 32-byte stripe
+static void xxh64_consume(struct xxh64* state, const unsigned char* p) {
+    for (int i = 0; i < 4; i++) {
+        state->v[i] = xxh64_round(state->v[i], xxh64_read64(p + i * 8));
+    }
+}
+
+// Function to start a hash with seed 0
+void xxh64_init(struct xxh64* state) {
+    state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = XXH_PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = 0 - XXH_PRIME64_1;
+    state->total = 0;
+    state->buffered = 0;
+}
+
+// Function to add data to a hash
+void xxh64_update(struct xxh64* state, const void* data, size_t len) {
+    const unsigned char* p = data;
+    
+    state->total += len;
+    if (state->buffered + len < sizeof(state->stripe)) {
+        memcpy(state->stripe + state->buffered, p, len);
+        state->buffered += len;
+        return;
+    }
+    if (state->buffered > 0) {
+        size_t fill = sizeof(state->stripe) - state->buffered;
+        memcpy(state->stripe + state->buffered, p, fill);
+        xxh64_consume(state, state->stripe);
+        p += fill;
+        len -= fill;
+        state->buffered = 0;
+    }
+    for (; len >= sizeof(state->stripe); p += sizeof(state->stripe), len -= sizeof(state->stripe)) {
+        xxh64_consume(state, p);
+    }
+    memcpy(state->stripe, p, len);
+    state->buffered = len;
+}
+
+// Function to finish a hash; the state stays usable for more data
+uint64_t xxh64_digest(const struct xxh64* state) {
+    const unsigned char* p = state->stripe;
+    size_t len = state->buffered;
+    uint64_t hash;
+    
+    if (state->total >= sizeof(state->stripe)) {
+        hash = xxh64_rotl(state->v[0], 1) + xxh64_rotl(state->v[1], 7) +
+               xxh64_rotl(state->v[2], 12) + xxh64_rotl(state->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = xxh64_merge(hash, state->v[i]);
+        }
+    } else {
+        hash = state->v[2] + XXH_PRIME64_5;
+    }
+    hash += state->total;
+    
+    for (; len >= 8; p += 8, len -= 8) {
+        hash ^= xxh64_round(0, xxh64_read64(p));
+        hash = xxh64_rotl(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (len >= 4) {
+        hash ^= xxh64_read32(p) * XXH_PRIME64_1;
+        hash = xxh64_rotl(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        hash ^= *p * XXH_PRIME64_5;
+        hash = xxh64_rotl(hash, 11) * XXH_PRIME64_1;
+    }
+    
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Function to decide whether a failed transfer is worth retrying
+int is_retryable(CURLcode res, long response_code) {
+    switch (res) {
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_RECV_ERROR:
+        case CURLE_SEND_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_RANGE_ERROR:
+            return 1;
+        case CURLE_HTTP_RETURNED_ERROR:
+            // Server hiccups and rejected ranges are transient, missing files are not
+            return response_code >= 500 || response_code == 416 || response_code == 408;
+        default:
+            return 0;
+    }
+}
+
+// Function to get a monotonic timestamp in seconds
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Function to clear the per-run figures of a session; handles, connections and buffers stay
+void session_reset_run(struct transfer_session* session) {
+    session->connections = 0;
+    session->retries = 0;
+    session->stalls = 0;
+    session->stall_seconds = 0;
+    session->started = 0;
+    session->first_byte = 0;
+    session->bytes = 0;
+    session->completed = 0;
+    session->stat_count = 0;
+    session->skipped_existing = 0;
+    session->skipped_index = 0;
+    session->duplicates = 0;
+    session->repaired = 0;
+    session->batch.batches = 0;
+    session->batch.committed = 0;
+    session->batch.sync_seconds = 0;
+    
+    for (int t = 0; t < session->target_count; t++) {
+        session->targets[t].bytes = 0;
+        session->targets[t].write_seconds = 0;
+        session->targets[t].slow_writes = 0;
+        session->targets[t].failed = 0;
+    }
+    
+    // The workers are idle between runs, so their counters can be cleared without the lock
+    if (session->post) {
+        session->post->processed = 0;
+        session->post->failed = 0;
+    }
+    if (session->pool) {
+        session->pool->peak_in_use = 0;
+        session->pool->pauses = 0;
+        session->pool->paused_seconds = 0;
+    }
+    
+    // Folders may have been moved away since the last run
+    if (session->dirs.keys) {
+        memset(session->dirs.keys, 0, session->dirs.capacity * sizeof(uint32_t));
+    }
+    session->dirs.count = 0;
+}
+
+// Function to initialize the transfer session with a pool of reusable handles
+int session_init(struct transfer_session* session, int jobs, int camera_count) {
+    session->stall_speed = 1024;
+    session->stall_time = 15;
+    session->jobs = jobs;
+    session->camera_count = camera_count;
+    session->slot_count = jobs * camera_count;
+    session->stats = NULL;
+    session->stat_capacity = 0;
+    session->write_buffer = DEFAULT_WRITE_BUFFER;
+    session->direct = 0;
+    session->sync_bytes = 0;
+    session->layout = LAYOUT_DAY;
+    session->verify = 0;
+    session->dirs.keys = NULL;
+    session->dirs.capacity = 0;
+    session->post = NULL;
+    session->pool = NULL;
+    session->preview = NULL;
+    session->preview_dir = NULL;
+    session->adaptive = 0;
+    session->commit_files = 0;
+    session->commit_seconds = DEFAULT_COMMIT_SECONDS;
+    memset(&session->batch, 0, sizeof(session->batch));
+    memset(session->targets, 0, sizeof(session->targets));
+    session->target_count = 1;
+    session_reset_run(session);
+    session->multi = NULL;
+    session->listings = calloc(camera_count, sizeof(CURL*));
+    session->slots = calloc(session->slot_count, sizeof(struct transfer));
+    if (!session->listings || !session->slots) {
+        fprintf(stderr, "Failed to allocate transfer slots\n");
+        return -1;
+    }
+    
+    // The multi handle owns the connection cache shared by every transfer
+    session->multi = curl_multi_init();
+    if (!session->multi) {
+        fprintf(stderr, "Failed to initialize curl session\n");
+        return -1;
+    }
+    // One connection per download plus one for the listing running alongside them, for each camera
+    curl_multi_setopt(session->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)jobs + 1);
+    
+    for (int i = 0; i < camera_count; i++) {
+        session->listings[i] = curl_easy_init();
+        if (!session->listings[i]) {
+            fprintf(stderr, "Failed to initialize curl session\n");
+            return -1;
+        }
+    }
+    
+    for (int i = 0; i < session->slot_count; i++) {
+        session->slots[i].session = session;
+        for (int t = 0; t < MAX_TARGETS; t++) {
+            session->slots[i].out[t].fd = -1;
+        }
+        session->slots[i].handoff = -1;
+        session->slots[i].curl = curl_easy_init();
+        if (!session->slots[i].curl) {
+            fprintf(stderr, "Failed to initialize curl session\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to reset a handle for a new request, keeping live connections
+void session_prepare(CURL* curl, const char* url) {
+    // curl_easy_reset() clears per-request options but leaves the connection cache intact
+    curl_easy_reset(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    
+    // Keep the connection alive between requests
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 10L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 5L);
+}
+
+// Function to account for the connections opened by a finished transfer
+void session_count_connections(struct transfer_session* session, CURL* curl) {
+    long connects = 0;
+    
+    if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK) {
+        session->connections += connects;
+    }
+}
+
+// Function to release the transfer session
+void session_cleanup(struct transfer_session* session) {
+    if (session->slots) {
+        for (int i = 0; i < session->slot_count; i++) {
+            if (session->slots[i].curl) {
+                curl_easy_cleanup(session->slots[i].curl);
+            }
+            for (int t = 0; t < MAX_TARGETS; t++) {
+                free(session->slots[i].out[t].buffer);
+            }
+        }
+        free(session->slots);
+        session->slots = NULL;
+    }
+    if (session->listings) {
+        for (int i = 0; i < session->camera_count; i++) {
+            if (session->listings[i]) {
+                curl_easy_cleanup(session->listings[i]);
+            }
+        }
+        free(session->listings);
+        session->listings = NULL;
+    }
+    if (session->multi) {
+        curl_multi_cleanup(session->multi);
+        session->multi = NULL;
+    }
+    free(session->stats);
+    session->stats = NULL;
+    free(session->dirs.keys);
+    session->dirs.keys = NULL;
+    free(session->batch.files);
+    session->batch.files = NULL;
+}
+
+// Function to read a CURLINFO time in seconds
+double transfer_time(CURL* curl, CURLINFO info) {
+    curl_off_t usec = 0;
+    curl_easy_getinfo(curl, info, &usec);
+    return (double)usec / 1e6;
+}
+
+// Function to account for a finished download attempt in the transfer statistics
+void session_record_transfer(struct transfer_session* session, struct transfer* xfer, int ok) {
+    curl_off_t bytes = 0;
+    curl_off_t speed = 0;
+    long connects = 0;
+    
+    curl_easy_getinfo(xfer->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    curl_easy_getinfo(xfer->curl, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+    curl_easy_getinfo(xfer->curl, CURLINFO_NUM_CONNECTS, &connects);
+    if (ok) {
+        session->bytes += (uint64_t)bytes;
+        session->completed++;
+    }
+    
+    // Requests are timed by curl from their start, so the phases are placed back from now
+#ifdef WITH_TRACE
+    double total = transfer_time(xfer->curl, CURLINFO_TOTAL_TIME_T);
+    double connected = transfer_time(xfer->curl, CURLINFO_CONNECT_TIME_T);
+    double first_byte = transfer_time(xfer->curl, CURLINFO_STARTTRANSFER_TIME_T);
+    double begun = trace_now() - total;
+    if (connects > 0) {
+        TRACE_SPAN("connect", xfer->name, TRACE_SLOT(xfer), begun, begun + connected);
+    }
+    TRACE_SPAN("ttfb", xfer->name, TRACE_SLOT(xfer), begun + connected, begun + first_byte);
+    TRACE_SPAN("body", xfer->name, TRACE_SLOT(xfer), begun + first_byte, begun + total);
+#endif
+    
+    // The adaptive controller judges each camera by the transfers that finished in its current window
+    struct adaptive* ad = &xfer->camera->adapt;
+    ad->ttfb_sum += transfer_time(xfer->curl, CURLINFO_STARTTRANSFER_TIME_T);
+    ad->finished++;
+    ad->failures += !ok && xfer->retryable; // A missing photo or a full disk says nothing about the load
+    
+    if (session->stat_count >= session->stat_capacity) {
+        int capacity = session->stat_capacity ? session->stat_capacity * 2 : 64;
+        struct transfer_stat* grown = realloc(session->stats, capacity * sizeof(struct transfer_stat));
+        if (!grown) {
+            return; // Statistics only, the import itself is unaffected
+        }
+        session->stats = grown;
+        session->stat_capacity = capacity;
+    }
+    
+    struct transfer_stat* st = &session->stats[session->stat_count++];
+    st->camera = xfer->camera;
+    st->photo_index = xfer->photo_index;
+    st->attempt = xfer->attempt;
+    st->ok = ok;
+    st->bytes = (uint64_t)bytes;
+    st->seconds = transfer_time(xfer->curl, CURLINFO_TOTAL_TIME_T);
+    st->connect = connects > 0 ? transfer_time(xfer->curl, CURLINFO_CONNECT_TIME_T) : 0;
+    st->ttfb = transfer_time(xfer->curl, CURLINFO_STARTTRANSFER_TIME_T);
+    st->speed = (double)speed;
+    st->connects = connects;
+}
+
+// Function to set up the progress display; auto uses the status line only on a terminal
+void progress_init(struct progress* pr, int mode, double now) {
+    if (mode == PROGRESS_AUTO) {
+        mode = isatty(STDOUT_FILENO) ? PROGRESS_BAR : PROGRESS_LINES;
+    }
+    pr->mode = mode;
+    pr->interval = mode == PROGRESS_BAR ? PROGRESS_BAR_INTERVAL : PROGRESS_LINE_INTERVAL;
+    pr->next_draw = now + pr->interval;
+    pr->drawn = 0;
+    pr->last_bytes = 0;
+    pr->last_time = now;
+    pr->rate = 0;
+}
+
+// Function to take the status line off the screen before other output is printed
+void progress_break(struct progress* pr) {
+    if (pr->drawn) {
+        fputs("\r\033[K", stdout);
+        pr->drawn = 0;
+    }
+}
+
+// Function to format a duration as m:ss or h:mm:ss
+void format_duration(double seconds, char* out, size_t size) {
+    long total = (long)(seconds + 0.5);
+    if (total >= 3600) {
+        snprintf(out, size, "%ld:%02ld:%02ld", total / 3600, total / 60 % 60, total % 60);
+    } else {
+        snprintf(out, size, "%ld:%02ld", total / 60, total % 60);
+    }
+}
+
+// Function to redraw the progress display when it is due. Byte counts are read from the
+// handles here, at the redraw rate, rather than reported by a callback on every transfer tick.
+void progress_update(struct transfer_session* session, const struct camera* cameras, int camera_count, double now) {
+    struct progress* pr = &session->progress;
+    
+    // A status line taken down for other output comes back right away
+    if (pr->mode == PROGRESS_NONE ||
+        (now < pr->next_draw && (pr->mode == PROGRESS_LINES || pr->drawn))) {
+        return;
+    }
+    
+    int listed = 0;
+    int next = 0;
+    int pending = 0;
+    int listing_done = 1;
+    for (int c = 0; c < camera_count; c++) {
+        listed += cameras[c].listing.list.count;
+        next += cameras[c].listing.list.next;
+        pending += cameras[c].retry_count;
+        listing_done = listing_done && !cameras[c].listing.running;
+    }
+    
+    uint64_t in_flight = 0;
+    int active = 0;
+    for (int s = 0; s < session->slot_count; s++) {
+        curl_off_t downloaded = 0;
+        if (session->slots[s].active &&
+            curl_easy_getinfo(session->slots[s].curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded) == CURLE_OK) {
+            in_flight += (uint64_t)downloaded;
+            active++;
+        }
+    }
+    uint64_t bytes = session->bytes + in_flight;
+    
+    // Rate over the time since the last sample, smoothed on the status line
+    double elapsed = now - pr->last_time;
+    if (elapsed >= PROGRESS_BAR_INTERVAL) {
+        double rate = bytes > pr->last_bytes ? (double)(bytes - pr->last_bytes) / elapsed : 0;
+        pr->rate = pr->mode == PROGRESS_BAR && pr->rate > 0 ? pr->rate * 0.8 + rate * 0.2 : rate;
+        pr->last_bytes = bytes;
+        pr->last_time = now;
+    }
+    
+    // The remaining photos are estimated at the average size of those completed so far
+    int done = next - active - pending;
+    char eta[32] = "--";
+    if (listing_done && pr->rate > 0 && session->completed > 0) {
+        double average = (double)session->bytes / session->completed;
+        double remaining = (listed - done) * average - (double)in_flight;
+        format_duration(remaining > 0 ? remaining / pr->rate : 0, eta, sizeof(eta));
+    }
+    
+    char line[128];
+    snprintf(line, sizeof(line), "%d/%d%s photos, %d active, %.1f MB, %.2f MB/s, ETA %s",
+             done, listed, listing_done ? "" : "+", active,
+             (double)bytes / (1024.0 * 1024.0), pr->rate / (1024.0 * 1024.0), eta);
+    if (pr->mode == PROGRESS_BAR) {
+        printf("\r%s\033[K", line);
+        pr->drawn = 1;
+    } else {
+        printf("Progress: %s\n", line);
+    }
+    fflush(stdout);
+    pr->next_draw = now + pr->interval;
+}
+
+// Function to find the slot of a folder key in the cache
+size_t dir_cache_slot(const struct dir_cache* cache, uint32_t key) {
+    size_t mask = cache->capacity - 1;
+    size_t slot = (size_t)(key * 2654435761u) & mask;
+    while (cache->keys[slot] != 0 && cache->keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Function to check whether a folder was already ensured in this run
+int dir_cache_contains(const struct dir_cache* cache, uint32_t key) {
+    return cache->capacity > 0 && cache->keys[dir_cache_slot(cache, key)] == key;
+}
+
+// Function to remember an ensured folder; when out of memory the folder is simply checked again next time
+void dir_cache_add(struct dir_cache* cache, uint32_t key) {
+    if ((cache->count + 1) * 2 > cache->capacity) {
+        size_t capacity = cache->capacity ? cache->capacity * 2 : 64;
+        uint32_t* keys = calloc(capacity, sizeof(uint32_t));
+        if (!keys) {
+            return;
+        }
+        struct dir_cache grown = { keys, capacity, cache->count };
+        for (size_t i = 0; i < cache->capacity; i++) {
+            if (cache->keys[i] != 0) {
+                keys[dir_cache_slot(&grown, cache->keys[i])] = cache->keys[i];
+            }
+        }
+        free(cache->keys);
+        *cache = grown;
+    }
+    cache->keys[dir_cache_slot(cache, key)] = key;
+    cache->count++;
+}
+
+// Function to make sure the date folder of a photo exists below target t, creating missing levels of the layout.
+// Each folder costs one mkdir per run; later photos of the same day do not touch the filesystem.
+int ensure_date_folder(struct transfer_session* session, int t, const char* base_path, uint32_t date,
+                       char* dir_path, size_t size) {
+    int levels = layout_levels(session->layout);
+    char folder[MAX_DATE];
+    
+    for (int level = 1; level <= levels; level++) {
+        format_layout_folder(date, session->layout, level, folder);
+        if (snprintf(dir_path, size, "%s/%s", base_path, folder) >= (int)size) {
+            fprintf(stderr, "Directory path too long: %s\n", dir_path);
+            return -1;
+        }
+        
+        // Truncate the date to this level, a month folder is shared by all its days
+        uint32_t truncated = level == levels ? date : level == 1 ? date / 10000 * 10000 : date / 100 * 100;
+        uint32_t key = ((uint32_t)t << 30) | ((uint32_t)level << 28) | truncated;
+        if (dir_cache_contains(&session->dirs, key)) {
+            continue;
+        }
+        if (create_directory(dir_path) != 0) {
+            return -1;
+        }
+        dir_cache_add(&session->dirs, key);
+    }
+    return 0;
+}
+
+// Function to build the path a photo is stored under; photos of a labelled camera carry the label
+// so that cameras never collide in the shared folders. suffix is appended to the name, for previews.
+int format_photo_path(const struct transfer_session* session, const char* base_path, uint32_t date,
+                      const char* label, const char* name, const char* suffix, char* path, size_t size) {
+    char folder[MAX_DATE];
+    
+    format_layout_folder(date, session->layout, layout_levels(session->layout), folder);
+    if (snprintf(path, size, "%s/%s/%s%s%s%s", base_path, folder, label, label[0] ? "-" : "", name, suffix) >= (int)size) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to name the preview of a photo. The camera sends JPEG previews, so other formats get a .jpg
+// suffix, which also keeps the previews of a RAW+JPEG pair apart.
+const char* preview_suffix(const char* name) {
+    return matches_format(name, "jpg") ? "" : ".jpg";
+}
+
+// Function to write a whole buffer to a file descriptor
+int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Function to copy the first size bytes of one file to the current position of another. The kernel copies
+// where it can; otherwise the data goes through buffer. Returns 0 once everything was copied.
+int copy_range(int in, int out, uint64_t size, char* buffer, size_t buffer_size) {
+    loff_t copied = 0;
+    
+    while ((uint64_t)copied < size) {
+        ssize_t n = copy_file_range(in, &copied, out, NULL, (size_t)(size - (uint64_t)copied), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+    }
+    
+    // Filesystems that cannot copy between each other get an ordinary read and write
+    while ((uint64_t)copied < size) {
+        size_t want = size - (uint64_t)copied < buffer_size ? (size_t)(size - (uint64_t)copied) : buffer_size;
+        ssize_t n = pread(in, buffer, want, copied);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || write_all(out, buffer, (size_t)n) != 0) {
+            return -1;
+        }
+        copied += n;
+    }
+    return 0;
+}
+
+// Function to reserve disk space for the rest of a download without changing the file size,
+// so a partial file still ends where its data ends and can be resumed
+void transfer_preallocate(struct transfer* xfer, curl_off_t length) {
+    // Filesystems without support simply get the file written as it arrives
+    for (int t = 0; t < xfer->session->target_count; t++) {
+        if (xfer->out[t].fd >= 0) {
+            fallocate(xfer->out[t].fd, FALLOC_FL_KEEP_SIZE, (off_t)xfer->resume_from, (off_t)length);
+        }
+    }
+}
+
+// Function to write data to the file of one target; fdatasync runs in batches of sync_bytes
+// and once more on the final write. The time it takes is charged to the target.
+int output_write(struct transfer_session* session, struct write_target* target, struct transfer_output* out,
+                 const char* data, size_t len, int final) {
+    size_t written = len;
+    double started = now_seconds();
+    
+    // O_DIRECT only takes whole blocks, the unaligned tail of a file goes through the page cache
+    if (out->direct && len % WRITE_ALIGN != 0) {
+        size_t aligned = len - len % WRITE_ALIGN;
+        int flags = -1;
+        if (write_all(out->fd, data, aligned) != 0 ||
+            (flags = fcntl(out->fd, F_GETFL)) == -1 ||
+            fcntl(out->fd, F_SETFL, flags & ~O_DIRECT) == -1) {
+            perror("write");
+            return -1;
+        }
+        out->direct = 0;
+        data += aligned;
+        len -= aligned;
+    }
+    if (write_all(out->fd, data, len) != 0) {
+        perror("write");
+        return -1;
+    }
+    out->unsynced += written;
+    target->bytes += written;
+    
+    if (session->sync_bytes > 0 && out->unsynced > 0 &&
+        (final || out->unsynced >= session->sync_bytes)) {
+        if (fdatasync(out->fd) != 0) {
+            perror("fdatasync");
+            return -1;
+        }
+        out->unsynced = 0;
+    }
+    double took = now_seconds() - started;
+    target->write_seconds += took;
+    target->slow_writes += took >= SLOW_WRITE_SECONDS;
+    return 0;
+}
+
+// Function to write out the buffered data of one target from the transfer loop
+int output_flush(struct transfer_session* session, struct write_target* target, struct transfer_output* out, int final) {
+    size_t len = out->buffered;
+    
+    out->buffered = 0;
+    return output_write(session, target, out, out->buffer, len, final);
+}
+
+// Function to write the blocks queued for one target, in the order they were queued. Once a block
+// of a file fails, the remaining ones of that file are only handed back.
+static void* write_worker(void* arg) {
+    struct write_queue* queue = arg;
+    struct write_pool* pool = queue->pool;
+    struct transfer_session* session = pool->session;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!queue->head && !pool->stopping) {
+            pthread_cond_wait(&queue->ready, &pool->lock);
+        }
+        struct write_block* block = queue->head;
+        if (!block) {
+            break;
+        }
+        queue->head = block->next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+        struct transfer_output* out = block->out;
+        int skip = out->failed;
+        pthread_mutex_unlock(&pool->lock);
+        
+        // The transfer loop reads the figures of the target, so they are counted here and added under the lock
+        struct write_target counts = {0};
+        TRACE_BEGIN(write_started);
+        int rc = skip ? 0 : output_write(session, &counts, out, block->data, block->len, block->final);
+        TRACE_END(write_started, block->final ? "write+sync" : "write", strrchr(out->filepath, '/') + 1,
+                  TRACE_WRITER_TRACK + queue->target);
+        
+        pthread_mutex_lock(&pool->lock);
+        queue->written.bytes += counts.bytes;
+        queue->written.write_seconds += counts.write_seconds;
+        queue->written.slow_writes += counts.slow_writes;
+        out->failed = out->failed || rc != 0;
+        out->pending--;
+        block->next = pool->free_list;
+        pool->free_list = block;
+        pool->free_count++;
+        pthread_cond_broadcast(&pool->returned);
+        if (pool->waiting) {
+            curl_multi_wakeup(session->multi);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Function to take a free block for an output, waiting for a writer thread to hand one back when none is left
+void write_pool_take(struct write_pool* pool, struct transfer_output* out) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->free_list) {
+        pthread_cond_wait(&pool->returned, &pool->lock);
+    }
+    out->block = pool->free_list;
+    pool->free_list = out->block->next;
+    pool->free_count--;
+    if (pool->count - pool->free_count > pool->peak_in_use) {
+        pool->peak_in_use = pool->count - pool->free_count;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    out->buffered = 0;
+}
+
+// Function to put back the block of an output without writing it
+void write_pool_release(struct write_pool* pool, struct transfer_output* out) {
+    if (!out->block) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    out->block->next = pool->free_list;
+    pool->free_list = out->block;
+    pool->free_count++;
+    pthread_mutex_unlock(&pool->lock);
+    out->block = NULL;
+    out->buffered = 0;
+}
+
+// Function to queue the block of an output to the writer thread of its target. The final block is
+// queued even when empty, the writer syncs the file after it.
+void write_pool_submit(struct write_pool* pool, int t, struct transfer_output* out, int final) {
+    struct write_queue* queue = &pool->queues[t];
+    
+    if (!out->block) {
+        write_pool_take(pool, out);
+    }
+    struct write_block* block = out->block;
+    block->len = out->buffered;
+    block->out = out;
+    block->final = final;
+    block->next = NULL;
+    out->block = NULL;
+    out->buffered = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    if (queue->tail) {
+        queue->tail->next = block;
+    } else {
+        queue->head = block;
+    }
+    queue->tail = block;
+    out->pending++;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Function to check whether the writer threads are done with every block of a transfer
+int write_pool_drained(struct write_pool* pool, const struct transfer* xfer) {
+    int pending = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (int t = 0; t < pool->session->target_count; t++) {
+        pending += xfer->out[t].pending;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return pending == 0;
+}
+
+// Function to wait until every block of a transfer is written. Returns the targets whose writes failed as a bit mask.
+int write_pool_wait(struct write_pool* pool, struct transfer* xfer) {
+    int failed = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (int t = 0; t < pool->session->target_count; t++) {
+        while (xfer->out[t].pending > 0) {
+            pthread_cond_wait(&pool->returned, &pool->lock);
+        }
+        failed |= xfer->out[t].failed << t;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return failed;
+}
+
+// Function to add what the writer threads wrote since the last call to the figures of the targets
+void write_pool_collect(struct write_pool* pool) {
+    struct transfer_session* session = pool->session;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (int t = 0; t < session->target_count; t++) {
+        struct write_target* written = &pool->queues[t].written;
+        session->targets[t].bytes += written->bytes;
+        session->targets[t].write_seconds += written->write_seconds;
+        session->targets[t].slow_writes += written->slow_writes;
+        written->bytes = 0;
+        written->write_seconds = 0;
+        written->slow_writes = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Function to allocate the blocks of the write pool and start one writer thread per target.
+// Every output of every slot can hold a block while the next one fills, so fewer blocks could deadlock.
+int write_pool_start(struct transfer_session* session, struct write_pool* pool, long megabytes) {
+    int needed = 2 * session->slot_count * session->target_count;
+    void* memory = NULL;
+    
+    memset(pool, 0, sizeof(*pool));
+    pool->session = session;
+    pool->count = (int)((uint64_t)megabytes * 1024 * 1024 / session->write_buffer);
+    if (pool->count < needed) {
+        fprintf(stderr, "Error: --write-pool needs at least %llu MB with %d transfers writing %d copies each\n",
+                (unsigned long long)(((uint64_t)needed * session->write_buffer + 1024 * 1024 - 1) / (1024 * 1024)),
+                session->slot_count, session->target_count);
+        return -1;
+    }
+    pool->blocks = calloc(pool->count, sizeof(struct write_block));
+    if (!pool->blocks || posix_memalign(&memory, WRITE_ALIGN, (size_t)pool->count * session->write_buffer) != 0) {
+        fprintf(stderr, "Not enough memory for the write pool\n");
+        free(pool->blocks);
+        return -1;
+    }
+    pool->memory = memory;
+    for (int i = 0; i < pool->count; i++) {
+        pool->blocks[i].data = pool->memory + (size_t)i * session->write_buffer;
+        pool->blocks[i].next = i + 1 < pool->count ? &pool->blocks[i + 1] : NULL;
+    }
+    pool->free_list = pool->blocks;
+    pool->free_count = pool->count;
+    
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->returned, NULL);
+    for (int t = 0; t < session->target_count; t++) {
+        struct write_queue* queue = &pool->queues[t];
+        queue->pool = pool;
+        queue->target = t;
+        TRACE_TRACK("writer", TRACE_WRITER_TRACK + t, t);
+        pthread_cond_init(&queue->ready, NULL);
+        if (pthread_create(&queue->thread, NULL, write_worker, queue) != 0) {
+            fprintf(stderr, "Failed to start the writer threads\n");
+            session->pool = pool;
+            return -1;
+        }
+        queue->started = 1;
+    }
+    session->pool = pool;
+    return 0;
+}
+
+// Function to stop the writer threads once their queues are written and release the blocks
+void write_pool_stop(struct write_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    for (int t = 0; t < MAX_TARGETS; t++) {
+        if (pool->queues[t].started) {
+            pthread_cond_signal(&pool->queues[t].ready);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (int t = 0; t < MAX_TARGETS; t++) {
+        if (pool->queues[t].started) {
+            pthread_join(pool->queues[t].thread, NULL);
+        }
+        if (pool->queues[t].pool) {
+            pthread_cond_destroy(&pool->queues[t].ready);
+        }
+    }
+    pthread_cond_destroy(&pool->returned);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->memory);
+    free(pool->blocks);
+    pool->session->pool = NULL;
+}
+
+// Function to give up the copy of a download on an additional target after an error; the download goes on
+void transfer_drop_mirror(struct transfer* xfer, int t) {
+    struct transfer_output* out = &xfer->out[t];
+    
+    fprintf(stderr, "Cannot write %s, continuing without this copy\n", out->partpath);
+    if (out->fd >= 0) {
+        close(out->fd);
+        out->fd = -1;
+    }
+    unlink(out->partpath);
+    out->buffered = 0;
+    out->active = 0;
+    if (xfer->session->pool) {
+        write_pool_release(xfer->session->pool, out);
+    }
+    xfer->session->targets[t].failed++;
+}
+
+// Function to add received data to the buffer of one target, writing it out whenever the buffer fills.
+// With the write pool a full block goes to the writer thread instead. Returns -1 only when the primary target fails.
+int output_append(struct transfer* xfer, int t, const char* data, size_t len) {
+    struct transfer_session* session = xfer->session;
+    struct transfer_output* out = &xfer->out[t];
+    
+    while (len > 0 && out->active) {
+        if (session->pool && !out->block) {
+            write_pool_take(session->pool, out);
+        }
+        char* buffer = session->pool ? out->block->data : out->buffer;
+        size_t room = session->write_buffer - out->buffered;
+        size_t n = len < room ? len : room;
+        memcpy(buffer + out->buffered, data, n);
+        out->buffered += n;
+        data += n;
+        len -= n;
+        if (out->buffered < session->write_buffer) {
+            continue;
+        }
+        if (session->pool) {
+            write_pool_submit(session->pool, t, out, 0);
+            continue;
+        }
+        TRACE_BEGIN(write_started);
+        int rc = output_flush(session, &session->targets[t], out, 0);
+        TRACE_END(write_started, "write", xfer->name, TRACE_SLOT(xfer));
+        if (rc != 0) {
+            if (t == 0) {
+                return -1;
+            }
+            transfer_drop_mirror(xfer, t);
+        }
+    }
+    return 0;
+}
+
+// Function to check, before a chunk is taken from the network, that the write pool can hold it.
+// Returns 0 when the transfer has to pause, -1 when the primary target failed and 1 to go ahead;
+// an additional target whose writes failed is given up here.
+int transfer_reserve(struct transfer* xfer, size_t len) {
+    struct transfer_session* session = xfer->session;
+    struct write_pool* pool = session->pool;
+    int needed = 0;
+    int failed = 0;
+    int free_count;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (int t = 0; t < session->target_count; t++) {
+        const struct transfer_output* out = &xfer->out[t];
+        if (!out->active) {
+            continue;
+        }
+        failed |= out->failed << t;
+        // A chunk never exceeds one block, so it starts at most one block more
+        needed += !out->block || out->buffered + len > session->write_buffer;
+    }
+    free_count = pool->free_count;
+    pthread_mutex_unlock(&pool->lock);
+    
+    if (failed & 1) {
+        return -1;
+    }
+    for (int t = 1; t < session->target_count; t++) {
+        if (failed & (1 << t)) {
+            transfer_drop_mirror(xfer, t);
+        }
+    }
+    return free_count >= needed;
+}
+
+// Function to write out the buffered data of every target of a transfer. With the write pool the data
+// is queued instead, and write errors show up once the writer threads are done with the transfer.
+int transfer_flush(struct transfer* xfer, int final) {
+    struct transfer_session* session = xfer->session;
+    
+    for (int t = 0; t < session->target_count; t++) {
+        struct transfer_output* out = &xfer->out[t];
+        if (session->pool) {
+            if (out->fd >= 0 && out->active && !out->sealed && (out->block || final)) {
+                write_pool_submit(session->pool, t, out, final);
+                out->sealed = final;
+            }
+            continue;
+        }
+        if (out->fd < 0 || output_flush(session, &session->targets[t], out, final) == 0) {
+            continue;
+        }
+        if (t == 0) {
+            return -1;
+        }
+        transfer_drop_mirror(xfer, t);
+    }
+    return 0;
+}
+
+// Function to flush and close the partial files of a transfer
+int transfer_close(struct transfer* xfer) {
+    TRACE_BEGIN(close_started);
+    int rc = transfer_flush(xfer, 1);
+    
+    if (xfer->session->pool) {
+        int failed = write_pool_wait(xfer->session->pool, xfer);
+        rc = failed & 1 ? -1 : rc;
+        for (int t = 1; t < xfer->session->target_count; t++) {
+            if ((failed & (1 << t)) && xfer->out[t].active) {
+                transfer_drop_mirror(xfer, t);
+            }
+        }
+    }
+    for (int t = 0; t < xfer->session->target_count; t++) {
+        struct transfer_output* out = &xfer->out[t];
+        if (out->fd < 0) {
+            continue;
+        }
+        int closed = close(out->fd) == 0;
+        out->fd = -1;
+        if (closed) {
+            continue;
+        }
+        perror("close");
+        if (t == 0) {
+            rc = -1;
+        } else {
+            transfer_drop_mirror(xfer, t);
+        }
+    }
+    TRACE_END(close_started, "close", xfer->name, TRACE_SLOT(xfer));
+    return rc;
+}
+
+// Function to remove the copies on the additional targets of a download that did not complete.
+// A retry resumes from the primary target and copies its part over again.
+void transfer_discard_mirrors(struct transfer* xfer) {
+    for (int t = 1; t < xfer->session->target_count; t++) {
+        if (xfer->out[t].active) {
+            unlink(xfer->out[t].partpath);
+            xfer->out[t].active = 0;
+        }
+    }
+}
+
+// Function to hash the partial file a resumed download continues, using the slot's write buffer
+int transfer_hash_part(struct transfer* xfer) {
+    int fd = open(xfer->out[0].partpath, O_RDONLY);
+    uint64_t left = (uint64_t)xfer->resume_from;
+    
+    if (fd < 0) {
+        return -1;
+    }
+    while (left > 0) {
+        size_t want = left < xfer->session->write_buffer ? (size_t)left : xfer->session->write_buffer;
+        ssize_t n = read(fd, xfer->out[0].buffer, want);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        xxh64_update(&xfer->hash, xfer->out[0].buffer, (size_t)n);
+        left -= (uint64_t)n;
+    }
+    close(fd);
+    return 0;
+}
+
+// Function to open the copy of a download on an additional target. A resumed download continues
+// on every target, so the part already fetched is copied over from the primary target first.
+void transfer_open_mirror(struct transfer_session* session, struct transfer* xfer, int t, uint32_t date, const char* name) {
+    struct transfer_output* out = &xfer->out[t];
+    const char* root = session->targets[t].path;
+    char dir_path[MAX_PATH];
+    char path[MAX_FILEPATH];
+    
+    out->fd = -1;
+    out->buffered = 0;
+    out->preallocated = 0;
+    out->unsynced = 0;
+    out->direct = 0;
+    out->active = 0;
+    out->failed = 0;
+    out->sealed = 0;
+    if (ensure_date_folder(session, t, root, date, dir_path, sizeof(dir_path)) != 0 ||
+        format_photo_path(session, root, date, xfer->camera->label, name, "", path, sizeof(path)) != 0 ||
+        snprintf(out->partpath, sizeof(out->partpath), "%s" PART_SUFFIX, path) >= (int)sizeof(out->partpath)) {
+        fprintf(stderr, "Cannot create the copy of %s in %s, continuing without it\n", name, root);
+        session->targets[t].failed++;
+        return;
+    }
+    memcpy(out->filepath, path, sizeof(path));
+    out->fd = open(out->partpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    out->active = 1;
+    if (out->fd < 0) {
+        transfer_drop_mirror(xfer, t);
+        return;
+    }
+    if (xfer->resume_from > 0) {
+        int in = open(xfer->out[0].partpath, O_RDONLY | O_CLOEXEC);
+        char* buffer = session->pool ? xfer->out[0].buffer : out->buffer;
+        int copied = in >= 0 && copy_range(in, out->fd, (uint64_t)xfer->resume_from, buffer, session->write_buffer) == 0;
+        if (in >= 0) {
+            close(in);
+        }
+        if (!copied) {
+            transfer_drop_mirror(xfer, t);
+            return;
+        }
+    }
+    
+    // The same block rule as for the primary target
+    if (session->direct && xfer->resume_from % WRITE_ALIGN == 0) {
+        int flags = fcntl(out->fd, F_GETFL);
+        out->direct = flags != -1 && fcntl(out->fd, F_SETFL, flags | O_DIRECT) == 0;
+    }
+}
+
+// Function to start downloading a single photo on a transfer slot.
+// Returns 1 when the transfer was started, 0 when the file was skipped and -1 on error.
+int download_photo(struct transfer_session* session, struct transfer* xfer, const char* name, const char* tag,
+                   uint32_t date, uint64_t expected, const char* base_path) {
+    char url[MAX_URL];
+    char full_dir_path[MAX_PATH];
+    struct stat st;
+    struct transfer_output* out = &xfer->out[0];
+    
+    // Validate input parameters
+    if (!session || !xfer || !xfer->camera || !name || !tag || !base_path) {
+        fprintf(stderr, "Invalid parameters to download_photo\n");
+        return -1;
+    }
+    
+    // base_path was validated once in main() and the folder is built from digits only,
+    // so the directory path needs no further checks
+    TRACE_BEGIN(ensure_started);
+    int ensured = ensure_date_folder(session, 0, base_path, date, full_dir_path, sizeof(full_dir_path));
+    TRACE_END(ensure_started, "ensure_dir", name, TRACE_SLOT(xfer));
+    if (ensured != 0) {
+        return -1;
+    }
+    
+    // Create full file path
+    format_photo_path(session, base_path, date, xfer->camera->label, name,
+                      session->preview ? preview_suffix(name) : "", out->filepath, sizeof(out->filepath));
+    if (snprintf(out->partpath, sizeof(out->partpath), "%s" PART_SUFFIX, out->filepath) >= (int)sizeof(out->partpath)) {
+        fprintf(stderr, "File path too long: %s\n", out->filepath);
+        return -1;
+    }
+    
+    // Check if file already exists; when verifying, a file shorter than the camera's copy is resumed.
+    // The primary target alone decides, the additional ones only receive what is downloaded.
+    if (stat(out->filepath, &st) == 0) {
+        if (!session->verify || expected == 0 || (uint64_t)st.st_size == expected) {
+            printf("File already exists, skipping: %s\n", out->filepath);
+            
+            // A cached preview counts as used again, so it is among the last to be evicted
+            if (session->preview) {
+                utimensat(AT_FDCWD, out->filepath, NULL, 0);
+            }
+            return 0;
+        }
+        if ((uint64_t)st.st_size > expected) {
+            fprintf(stderr, "%s is larger than the camera's copy (%lld of %llu bytes), leaving it alone\n",
+                    out->filepath, (long long)st.st_size, (unsigned long long)expected);
+            return -1;
+        }
+        printf("Truncated file, resuming: %s (%lld of %llu bytes)\n",
+               out->filepath, (long long)st.st_size, (unsigned long long)expected);
+        if (rename(out->filepath, out->partpath) != 0) {
+            perror("rename");
+            return -1;
+        }
+        session->repaired++;
+    }
+    
+    // Create download URL; a preview asks the camera for a reduced-size variant
+    snprintf(url, sizeof(url), "%s/v1/photos/%s/%s%s%s", xfer->camera->url, tag, name,
+             session->preview ? "?size=" : "", session->preview ? session->preview : "");
+    
+    strncpy(xfer->name, name, sizeof(xfer->name) - 1);
+    xfer->name[sizeof(xfer->name) - 1] = '\0';
+    
+    // Resume a partial download left by an earlier attempt
+    xfer->resume_from = 0;
+    if (stat(out->partpath, &st) == 0 && st.st_size > 0) {
+        xfer->resume_from = (curl_off_t)st.st_size;
+    }
+    
+    // Every slot keeps one aligned write buffer per target for all the photos it fetches; with the
+    // write pool the data goes into pool blocks and the slot keeps one buffer for reading files back
+    for (int t = 0; t < (session->pool ? 1 : session->target_count); t++) {
+        if (!xfer->out[t].buffer) {
+            void* buffer = NULL;
+            if (posix_memalign(&buffer, WRITE_ALIGN, session->write_buffer) != 0) {
+                fprintf(stderr, "Not enough memory for write buffer\n");
+                return -1;
+            }
+            xfer->out[t].buffer = buffer;
+        }
+    }
+    out->buffered = 0;
+    out->preallocated = 0;
+    out->unsynced = 0;
+    out->failed = 0;
+    out->sealed = 0;
+    xfer->paused = 0;
+    xfer->draining = 0;
+    xfer->expected = expected;
+    xfer->content = 0;
+    
+    // The hash covers the whole file, so the part already on disk is read once to seed it
+    xfer->hashing = session->verify;
+    if (xfer->hashing) {
+        xxh64_init(&xfer->hash);
+        if (xfer->resume_from > 0 && transfer_hash_part(xfer) != 0) {
+            fprintf(stderr, "Cannot read %s, downloading %s from the start\n", out->partpath, name);
+            xfer->resume_from = 0;
+            xxh64_init(&xfer->hash);
+        }
+    }
+    
+    // Open partial file for writing; O_DIRECT needs the file to continue on a block boundary.
+    // Post-processing reads the finished file back through this descriptor.
+    int flags = (session->post ? O_RDWR : O_WRONLY) | O_CREAT | O_CLOEXEC | (xfer->resume_from > 0 ? O_APPEND : O_TRUNC);
+    TRACE_BEGIN(open_started);
+    out->direct = session->direct && xfer->resume_from % WRITE_ALIGN == 0;
+    out->fd = open(out->partpath, flags | (out->direct ? O_DIRECT : 0), 0666);
+    if (out->fd < 0 && out->direct && errno == EINVAL) {
+        fprintf(stderr, "Warning: O_DIRECT not supported for %s, using buffered writes\n", base_path);
+        session->direct = 0;
+        out->direct = 0;
+        out->fd = open(out->partpath, flags, 0666);
+    }
+    if (out->fd < 0) {
+        perror("open");
+        return -1;
+    }
+    out->active = 1;
+    for (int t = 1; t < session->target_count; t++) {
+        transfer_open_mirror(session, xfer, t, date, name);
+    }
+    TRACE_END(open_started, "open", name, TRACE_SLOT(xfer));
+    
+    if (xfer->resume_from > 0) {
+        printf("Resuming %s at %.2f KB\n", name, (double)xfer->resume_from / 1024.0);
+    }
+    
+    session_prepare(xfer->curl, url);
+    curl_easy_setopt(xfer->curl, CURLOPT_WRITEFUNCTION, file_write_callback);
+    curl_easy_setopt(xfer->curl, CURLOPT_WRITEDATA, xfer);
+    curl_easy_setopt(xfer->curl, CURLOPT_BUFFERSIZE,
+                     (long)(session->write_buffer < MAX_RECEIVE_BUFFER ? session->write_buffer : MAX_RECEIVE_BUFFER));
+    
+    // Abort only transfers that stop making progress, however long a large file takes
+    curl_easy_setopt(xfer->curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(xfer->curl, CURLOPT_LOW_SPEED_LIMIT, session->stall_speed);
+    curl_easy_setopt(xfer->curl, CURLOPT_LOW_SPEED_TIME, session->stall_time);
+    curl_easy_setopt(xfer->curl, CURLOPT_PRIVATE, xfer);
+    curl_easy_setopt(xfer->curl, CURLOPT_RESUME_FROM_LARGE, xfer->resume_from);
+    
+    // Never append an HTTP error page to the partial file
+    curl_easy_setopt(xfer->curl, CURLOPT_FAILONERROR, 1L);
+    
+    if (curl_multi_add_handle(session->multi, xfer->curl) != CURLM_OK) {
+        fprintf(stderr, "Failed to start download for %s\n", name);
+        transfer_close(xfer);
+        transfer_discard_mirrors(xfer);
+        return -1;
+    }
+    
+    xfer->active = 1;
+    return 1;
+}
+
+// Function to close the descriptor kept for post-processing when the file is not handed on
+void transfer_release_handoff(struct transfer* xfer) {
+    if (xfer->handoff >= 0) {
+        close(xfer->handoff);
+        xfer->handoff = -1;
+    }
+}
+
+// Function to give up a download that could not be completed. Returns -1 for download_finish().
+int download_fail(struct transfer_session* session, struct transfer* xfer) {
+    transfer_release_handoff(xfer);
+    transfer_discard_mirrors(xfer);
+    session_record_transfer(session, xfer, 0);
+    return -1;
+}
+
+// Function to finish a download once its transfer is done
+int download_finish(struct transfer_session* session, struct transfer* xfer, CURLcode res) {
+    struct transfer_output* out = &xfer->out[0];
+    
+    curl_multi_remove_handle(session->multi, xfer->curl);
+    session_count_connections(session, xfer->curl);
+    xfer->active = 0;
+    xfer->retryable = 0;
+    if (xfer->paused) {
+        xfer->paused = 0;
+        session->pool->paused_seconds += now_seconds() - xfer->paused_at;
+    }
+    
+    if (res != CURLE_OK) {
+        fprintf(stderr, "Download failed for %s: %s\n", xfer->name, curl_easy_strerror(res));
+        transfer_close(xfer); // Whatever arrived stays on disk for the resume
+        
+        // A server that ignored the range or rejected it leaves nothing usable to resume from
+        long response_code = 0;
+        curl_easy_getinfo(xfer->curl, CURLINFO_RESPONSE_CODE, &response_code);
+        if (res == CURLE_RANGE_ERROR || response_code == 416) {
+            unlink(out->partpath);
+        } else {
+            printf("Partial download kept for resume: %s\n", out->partpath);
+        }
+        
+        // A timeout on a reused or established connection is a low-speed abort, so the transfer stalled
+        curl_off_t connect_time = 0;
+        long connects = 0;
+        curl_easy_getinfo(xfer->curl, CURLINFO_CONNECT_TIME_T, &connect_time);
+        curl_easy_getinfo(xfer->curl, CURLINFO_NUM_CONNECTS, &connects);
+        if (res == CURLE_OPERATION_TIMEDOUT && (connect_time > 0 || connects == 0)) {
+            session->stalls++;
+            session->stall_seconds += (double)session->stall_time;
+        }
+        
+        xfer->retryable = is_retryable(res, response_code);
+        return download_fail(session, xfer);
+    }
+    
+    // Post-processing gets a second descriptor of the open file, so the data is never read back from the media
+    xfer->handoff = session->post ? fcntl(out->fd, F_DUPFD_CLOEXEC, 0) : -1;
+    
+    if (transfer_close(xfer) != 0) {
+        return download_fail(session, xfer);
+    }
+    
+    curl_off_t downloaded = 0;
+    curl_easy_getinfo(xfer->curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+    xfer->size = xfer->resume_from + downloaded;
+    
+    // A transfer that ended cleanly but disagrees with the listed size is not the photo that was listed
+    if (xfer->hashing) {
+        if (xfer->expected && (uint64_t)xfer->size != xfer->expected) {
+            fprintf(stderr, "Size mismatch for %s: received %lld bytes, camera listed %llu\n",
+                    xfer->name, (long long)xfer->size, (unsigned long long)xfer->expected);
+            return download_fail(session, xfer);
+        }
+        xfer->content = xxh64_digest(&xfer->hash);
+    }
+    
+    // In durable mode the file keeps its temporary name until its batch is synced
+    if (session->commit_files > 0) {
+        session_record_transfer(session, xfer, 1);
+        return 0;
+    }
+    
+    // Publish the finished file under its final name, on every target that kept up
+    if (rename(out->partpath, out->filepath) != 0) {
+        perror("rename");
+        return download_fail(session, xfer);
+    }
+    for (int t = 1; t < session->target_count; t++) {
+        if (xfer->out[t].active && rename(xfer->out[t].partpath, xfer->out[t].filepath) != 0) {
+            perror("rename");
+            transfer_drop_mirror(xfer, t);
+        }
+    }
+    
+    session_record_transfer(session, xfer, 1);
+    printf("Completed: %s\n", out->filepath);
+    return 0;
+}
+
+// Function to take over what the rest of the import needs of a completed download, freeing its slot
+void completed_file_init(struct completed_file* file, struct transfer* xfer) {
+    file->camera = xfer->camera;
+    file->photo_index = xfer->photo_index;
+    file->size = (uint64_t)xfer->size;
+    file->content = xfer->content;
+    file->handoff = xfer->handoff;
+    file->targets = 0;
+    file->duplicate = 0;
+    xfer->handoff = -1;
+    for (int t = 0; t < xfer->session->target_count; t++) {
+        if (xfer->out[t].active) {
+            file->targets |= 1 << t;
+            memcpy(file->filepath[t], xfer->out[t].filepath, strlen(xfer->out[t].filepath) + 1);
+        }
+    }
+}
+
+// Function to close the descriptor kept for post-processing when the file is not handed on
+void completed_file_release(struct completed_file* file) {
+    if (file->handoff >= 0) {
+        close(file->handoff);
+        file->handoff = -1;
+    }
+}
+
+// Function to create the missing folders of a backup path, below the backup directory itself
+int post_make_folders(char* path, size_t root_len) {
+    for (char* slash = strchr(path + root_len + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int rc = mkdir(path, 0755);
+        *slash = '/';
+        if (rc != 0 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to copy a completed file into the backup tree. The kernel copies from the descriptor the
+// download wrote through, so the data comes from the page cache; a .part name hides unfinished copies.
+int post_copy(const struct post_pool* pool, struct post_job* job) {
+    const char* root = pool->options->post_copy;
+    char path[MAX_FILEPATH + MAX_PATH];
+    char partpath[MAX_FILEPATH + MAX_PATH + 8];
+    char buffer[65536];
+    int out;
+    
+    snprintf(path, sizeof(path), "%s%s", root, job->path + strlen(pool->base_path));
+    snprintf(partpath, sizeof(partpath), "%s" PART_SUFFIX, path);
+    if (post_make_folders(path, strlen(root)) != 0) {
+        fprintf(stderr, "Cannot create backup folder for %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if ((out = open(partpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", partpath, strerror(errno));
+        return -1;
+    }
+    int copied = copy_range(job->fd, out, job->size, buffer, sizeof(buffer)) == 0;
+    if (close(out) != 0 || !copied || rename(partpath, path) != 0) {
+        fprintf(stderr, "Backup copy of %s failed: %s\n", job->path, strerror(errno));
+        unlink(partpath);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to run a hook command for a completed file. The hook reads the photo on stdin, straight
+// from the open file, and finds its path in $1 and the photo details in RGR2_* variables.
+int post_exec(struct post_job* job, const char* command) {
+    extern char** environ;
+    char vars[6][MAX_FILEPATH + 16];
+    char date_folder[MAX_DATE];
+    size_t env_count = 0;
+    
+    while (environ[env_count]) {
+        env_count++;
+    }
+    char** envp = malloc((env_count + 7) * sizeof(char*));
+    if (!envp) {
+        fprintf(stderr, "Not enough memory to run hook for %s\n", job->path);
+        return -1;
+    }
+    format_date_folder(job->date, date_folder);
+    snprintf(vars[0], sizeof(vars[0]), "RGR2_FILE=%s", job->path);
+    snprintf(vars[1], sizeof(vars[1]), "RGR2_NAME=%s", job->name);
+    snprintf(vars[2], sizeof(vars[2]), "RGR2_TAG=%s", job->tag);
+    snprintf(vars[3], sizeof(vars[3]), "RGR2_DATE=%s", date_folder);
+    snprintf(vars[4], sizeof(vars[4]), "RGR2_CAMERA=%s", job->label);
+    snprintf(vars[5], sizeof(vars[5]), "RGR2_SIZE=%llu", (unsigned long long)job->size);
+    for (int i = 0; i < 6; i++) {
+        envp[i] = vars[i];
+    }
+    memcpy(envp + 6, environ, (env_count + 1) * sizeof(char*));
+    
+    char* argv[] = { "sh", "-c", (char*)command, "sh", job->path, NULL };
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int status = 0;
+    
+    lseek(job->fd, 0, SEEK_SET);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, job->fd, STDIN_FILENO);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 34)
+    // Connections to the camera and the files being written stay out of the hook
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+#endif
+    int rc = posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    free(envp);
+    if (rc != 0) {
+        fprintf(stderr, "Cannot run hook for %s: %s\n", job->path, strerror(rc));
+        return -1;
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Hook '%s' failed for %s\n", command, job->path);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to run every handler on a completed file; all of them run even when one fails
+int post_process(const struct post_pool* pool, struct post_job* job) {
+    const struct cli_options* options = pool->options;
+    int rc = 0;
+    
+    // Past POST_MAX_OPEN waiting files the descriptor was given up, the name is opened instead
+    if (job->fd < 0 && (job->fd = open(job->path, O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Cannot open %s for post-processing: %s\n", job->path, strerror(errno));
+        return -1;
+    }
+    
+    // The descriptor still carries the download's O_DIRECT and O_APPEND, reading wants neither
+    int flags = fcntl(job->fd, F_GETFL);
+    if (flags != -1) {
+        fcntl(job->fd, F_SETFL, flags & ~(O_DIRECT | O_APPEND));
+    }
+    
+    if (options->post_copy[0] != '\0' && post_copy(pool, job) != 0) {
+        rc = -1;
+    }
+    for (int i = 0; i < options->post_command_count; i++) {
+        if (post_exec(job, options->post_commands[i]) != 0) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+// Function for a post-processing thread: take the oldest waiting file until the pool stops and runs dry
+static void* post_worker(void* arg) {
+    struct post_pool* pool = arg;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->stopping) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        struct post_job* job = pool->head;
+        if (!job) {
+            break;
+        }
+        pool->head = job->next;
+        if (!pool->head) {
+            pool->tail = NULL;
+        }
+        pool->queued--;
+        pool->running++;
+        pthread_mutex_unlock(&pool->lock);
+        
+        int rc = post_process(pool, job);
+        if (job->fd >= 0) {
+            close(job->fd);
+        }
+        free(job);
+        
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+        if (rc == 0) {
+            pool->processed++;
+        } else {
+            pool->failed++;
+        }
+        if (!pool->head && pool->running == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Function to start the post-processing threads and attach them to the session
+int post_pool_start(struct transfer_session* session, struct post_pool* pool,
+                    const struct cli_options* options, const char* base_path) {
+    memset(pool, 0, sizeof(*pool));
+    pool->options = options;
+    pool->base_path = base_path;
+    
+    if (options->post_copy[0] != '\0') {
+        if (strcmp(options->post_copy, base_path) == 0) {
+            fprintf(stderr, "Error: The backup directory must differ from the target directory\n");
+            return -1;
+        }
+        if (create_directory(options->post_copy) != 0) {
+            return -1;
+        }
+    }
+    
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    for (int i = 0; i < options->post_jobs; i++) {
+        if (pthread_create(&pool->threads[i], NULL, post_worker, pool) != 0) {
+            fprintf(stderr, "Failed to start post-processing threads\n");
+            break;
+        }
+        pool->thread_count++;
+    }
+    session->post = pool;
+    return pool->thread_count > 0 ? 0 : -1;
+}
+
+// Function to hand a completed file to the post-processing threads, with the descriptor it was written through
+void post_pool_submit(struct post_pool* pool, struct completed_file* file) {
+    const struct photo_list* list = &file->camera->listing.list;
+    const struct photo* p = &list->photos[file->photo_index];
+    struct post_job* job = malloc(sizeof(struct post_job));
+    
+    if (!job) {
+        fprintf(stderr, "Not enough memory to post-process %s\n", file->filepath[0]);
+        completed_file_release(file);
+        return;
+    }
+    job->next = NULL;
+    job->fd = file->handoff;
+    job->size = file->size;
+    job->date = p->date;
+    snprintf(job->path, sizeof(job->path), "%s", file->filepath[0]);
+    snprintf(job->name, sizeof(job->name), "%s", photo_name(list, p));
+    snprintf(job->tag, sizeof(job->tag), "%s", photo_tag(list, p));
+    snprintf(job->label, sizeof(job->label), "%s", file->camera->label);
+    file->handoff = -1;
+    
+    pthread_mutex_lock(&pool->lock);
+    // A long backlog must not exhaust the descriptors, so later files wait by name only
+    if (pool->queued >= POST_MAX_OPEN && job->fd >= 0) {
+        close(job->fd);
+        job->fd = -1;
+    }
+    if (pool->tail) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pool->queued++;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Function to wait until every handed-over file has been post-processed
+void post_pool_drain(struct post_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queued > 0) {
+        printf("Waiting for %d files to finish post-processing\n", pool->queued);
+    }
+    while (pool->head || pool->running > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Function to stop the post-processing threads once they have worked through the queue
+void post_pool_stop(struct post_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->ready);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+// Function to initialize a streaming listing parser
+void objs_parser_init(struct objs_parser* p, int (*on_dir)(void*, const char*),
+                      int (*on_file)(void*, const char*, const char*, uint64_t), void* ctx) {
+    memset(p, 0, sizeof(*p));
+    p->expect_top = EXPECT_VALUE;
+    p->on_dir = on_dir;
+    p->on_file = on_file;
+    p->ctx = ctx;
+}
+
+// Function to release a streaming listing parser
+void objs_parser_free(struct objs_parser* p) {
+    free(p->pending);
+    p->pending = NULL;
+    p->pending_count = 0;
+    p->pending_capacity = 0;
+}
+
+// Function to record a parse error; returns -1 for convenience
+int objs_fail(struct objs_parser* p, const char* message) {
+    if (!p->error) {
+        p->error = message;
+        fprintf(stderr, "Error parsing JSON at byte %zu: %s\n", p->offset, message);
+    }
+    return -1;
+}
+
+// Function to append a byte to the current key or value token, truncating like strncpy
+void objs_append(struct objs_parser* p, char c) {
+    if (p->in_key) {
+        if (p->key_len < JSON_MAX_KEY - 1) {
+            p->key[p->key_len++] = c;
+        } else {
+            p->key_len = JSON_MAX_KEY; // Too long to be a key we care about
+        }
+    } else if (p->target != TARGET_NONE && p->token_len < sizeof(p->token) - 1) {
+        p->token[p->token_len++] = c;
+    }
+}
+
+// Function to append a decoded \uXXXX escape as UTF-8
+void objs_append_unicode(struct objs_parser* p, unsigned cp) {
+    if (cp < 0x80) {
+        objs_append(p, (char)cp);
+    } else if (cp < 0x800) {
+        objs_append(p, (char)(0xc0 | (cp >> 6)));
+        objs_append(p, (char)(0x80 | (cp & 0x3f)));
+    } else {
+        objs_append(p, (char)(0xe0 | (cp >> 12)));
+        objs_append(p, (char)(0x80 | ((cp >> 6) & 0x3f)));
+        objs_append(p, (char)(0x80 | (cp & 0x3f)));
+    }
+}
+
+// Function to hand a completed file entry to the consumer, or keep it until its directory name is known
+int objs_emit_file(struct objs_parser* p, const struct objs_file_entry* f) {
+    if (p->have_tag) {
+        if (p->on_file(p->ctx, f->name, f->has_date ? f->date : NULL, f->size) != 0) {
+            return objs_fail(p, "not enough memory for photo list");
+        }
+        return 0;
+    }
+    
+    if (p->pending_count >= p->pending_capacity) {
+        int capacity = p->pending_capacity ? p->pending_capacity * 2 : 16;
+        struct objs_file_entry* grown = realloc(p->pending, capacity * sizeof(struct objs_file_entry));
+        if (!grown) {
+            return objs_fail(p, "not enough memory for photo list");
+        }
+        p->pending = grown;
+        p->pending_capacity = capacity;
+    }
+    p->pending[p->pending_count++] = *f;
+    return 0;
+}
+
+// Function to deliver a completed string or number value to its target
+int objs_scalar_end(struct objs_parser* p) {
+    p->token[p->token_len] = '\0';
+    
+    switch (p->target) {
+        case TARGET_TAG:
+            memcpy(p->tag, p->token, p->token_len + 1);
+            p->have_tag = 1;
+            if (p->on_dir(p->ctx, p->tag) != 0) {
+                return objs_fail(p, "not enough memory for photo list");
+            }
+            
+            // Files listed before the directory name can go out now
+            for (int i = 0; i < p->pending_count; i++) {
+                if (objs_emit_file(p, &p->pending[i]) != 0) {
+                    return -1;
+                }
+            }
+            p->pending_count = 0;
+            break;
+        case TARGET_NAME:
+            memcpy(p->file.name, p->token, p->token_len + 1);
+            break;
+        case TARGET_DATE:
+            strncpy(p->file.date, p->token, sizeof(p->file.date) - 1);
+            p->file.date[sizeof(p->file.date) - 1] = '\0';
+            p->file.has_date = 1;
+            break;
+        case TARGET_SIZE: {
+            double size = strtod(p->token, NULL);
+            p->file.size = size > 0 ? (uint64_t)size : 0;
+            break;
+        }
+        default:
+            break;
+    }
+    return 0;
+}
+
+// Function to finish a number or literal token once a delimiter follows it
+int objs_bare_end(struct objs_parser* p) {
+    p->token[p->token_len] = '\0';
+    
+    if (p->lex == LEX_LITERAL) {
+        if (strcmp(p->token, "true") != 0 && strcmp(p->token, "false") != 0 && strcmp(p->token, "null") != 0) {
+            return objs_fail(p, "invalid literal");
+        }
+        return 0;
+    }
+    
+    char* end;
+    strtod(p->token, &end);
+    if (p->token_len == 0 || *end != '\0') {
+        return objs_fail(p, "invalid number");
+    }
+    return p->target == TARGET_SIZE ? objs_scalar_end(p) : 0;
+}
+
+// Function to start a value, working out what it means from where it appears in the listing
+int objs_begin_value(struct objs_parser* p, char c) {
+    int parent_role = p->depth ? p->stack[p->depth - 1].role : ROLE_OTHER;
+    int keyed = p->depth && p->stack[p->depth - 1].is_object && p->key_len < JSON_MAX_KEY;
+    const char* key = p->key;
+    
+    // Once this value ends its parent expects a separator
+    if (p->depth) {
+        p->stack[p->depth - 1].expect = EXPECT_COMMA_OR_END;
+    } else {
+        p->expect_top = EXPECT_NOTHING;
+    }
+    
+    if (c == '{' || c == '[') {
+        int is_object = c == '{';
+        int role = ROLE_OTHER;
+        
+        if (p->depth == 0 && is_object) {
+            role = ROLE_ROOT;
+        } else if (parent_role == ROLE_ROOT && keyed && !is_object && strcmp(key, "dirs") == 0) {
+            role = ROLE_DIRS;
+            p->saw_dirs = 1;
+        } else if (parent_role == ROLE_DIRS && is_object) {
+            role = ROLE_DIR;
+            p->have_tag = 0;
+            p->pending_count = 0;
+        } else if (parent_role == ROLE_DIR && keyed && !is_object && strcmp(key, "files") == 0) {
+            role = ROLE_FILES;
+        } else if (parent_role == ROLE_FILES && is_object) {
+            role = ROLE_FILE;
+            memset(&p->file, 0, sizeof(p->file));
+        }
+        
+        if (p->depth >= JSON_MAX_DEPTH) {
+            return objs_fail(p, "nesting too deep");
+        }
+        p->stack[p->depth].is_object = (unsigned char)is_object;
+        p->stack[p->depth].role = (unsigned char)role;
+        p->stack[p->depth].expect = is_object ? EXPECT_KEY_OR_END : EXPECT_VALUE_OR_END;
+        p->depth++;
+        return 0;
+    }
+    
+    // Scalars only matter as the directory name or as fields of a file entry
+    p->target = TARGET_NONE;
+    if (keyed && parent_role == ROLE_DIR && strcmp(key, "name") == 0 && c == '"') {
+        p->target = TARGET_TAG;
+    } else if (keyed && parent_role == ROLE_FILE) {
+        if (strcmp(key, "n") == 0 && c == '"') {
+            p->target = TARGET_NAME;
+        } else if (strcmp(key, "d") == 0 && c == '"') {
+            p->target = TARGET_DATE;
+        } else if (strcmp(key, "s") == 0 && c != '"') {
+            p->target = TARGET_SIZE;
+        }
+    }
+    p->token_len = 0;
+    p->in_key = 0;
+    
+    if (c == '"') {
+        p->lex = LEX_STRING;
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+        p->lex = LEX_NUMBER;
+        p->token[p->token_len++] = c;
+    } else if (c == 't' || c == 'f' || c == 'n') {
+        p->lex = LEX_LITERAL;
+        p->token[p->token_len++] = c;
+    } else {
+        return objs_fail(p, "unexpected character");
+    }
+    return 0;
+}
+
+// Function to close the innermost object or array
+int objs_end_container(struct objs_parser* p) {
+    struct json_level* level = &p->stack[--p->depth];
+    
+    if (level->role == ROLE_FILE) {
+        // Entries without a usable name are dropped, like the directory without a name below
+        if (p->file.name[0] != '\0') {
+            return objs_emit_file(p, &p->file);
+        }
+    } else if (level->role == ROLE_DIR) {
+        p->pending_count = 0;
+        p->have_tag = 0;
+    }
+    return 0;
+}
+
+// Function to process a structural character outside of a token
+int objs_structural(struct objs_parser* p, char c) {
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+        return 0;
+    }
+    
+    struct json_level* level = p->depth ? &p->stack[p->depth - 1] : NULL;
+    unsigned char* expect = level ? &level->expect : &p->expect_top;
+    
+    switch (*expect) {
+        case EXPECT_KEY_OR_END:
+            if (c == '}') {
+                return objs_end_container(p);
+            }
+            /* fall through */
+        case EXPECT_KEY:
+            if (c != '"') {
+                return objs_fail(p, "expected object key");
+            }
+            p->lex = LEX_STRING;
+            p->in_key = 1;
+            p->key_len = 0;
+            return 0;
+        case EXPECT_COLON:
+            if (c != ':') {
+                return objs_fail(p, "expected ':'");
+            }
+            *expect = EXPECT_VALUE;
+            return 0;
+        case EXPECT_VALUE_OR_END:
+            if (c == ']') {
+                return objs_end_container(p);
+            }
+            /* fall through */
+        case EXPECT_VALUE:
+            return objs_begin_value(p, c);
+        case EXPECT_COMMA_OR_END:
+            if (c == ',') {
+                *expect = level->is_object ? EXPECT_KEY : EXPECT_VALUE;
+                return 0;
+            }
+            if (c == (level->is_object ? '}' : ']')) {
+                return objs_end_container(p);
+            }
+            return objs_fail(p, "expected ',' or end of container");
+        default:
+            return objs_fail(p, "unexpected data after end of listing");
+    }
+}
+
+// Function to feed the next chunk of the listing into the parser
+int objs_parser_feed(struct objs_parser* p, const char* data, size_t len) {
+    if (p->error) {
+        return -1;
+    }
+    
+    for (size_t i = 0; i < len; i++, p->offset++) {
+        char c = data[i];
+        
+        switch (p->lex) {
+            case LEX_STRING:
+                if (c == '"') {
+                    p->lex = LEX_NONE;
+                    if (p->in_key) {
+                        p->in_key = 0;
+                        p->key[p->key_len < JSON_MAX_KEY ? p->key_len : JSON_MAX_KEY - 1] = '\0';
+                        p->stack[p->depth - 1].expect = EXPECT_COLON;
+                    } else if (p->target != TARGET_NONE && objs_scalar_end(p) != 0) {
+                        return -1;
+                    }
+                } else if (c == '\\') {
+                    p->lex = LEX_ESCAPE;
+                } else if ((unsigned char)c < 0x20) {
+                    return objs_fail(p, "control character in string");
+                } else {
+                    objs_append(p, c);
+                }
+                continue;
+            case LEX_ESCAPE: {
+                const char* from = "\"\\/bfnrt";
+                const char* to = "\"\\/\b\f\n\r\t";
+                const char* hit = c ? strchr(from, c) : NULL;
+                if (c == 'u') {
+                    p->lex = LEX_UNICODE;
+                    p->unicode = 0;
+                    p->unicode_digits = 0;
+                } else if (hit) {
+                    objs_append(p, to[hit - from]);
+                    p->lex = LEX_STRING;
+                } else {
+                    return objs_fail(p, "invalid escape sequence");
+                }
+                continue;
+            }
+            case LEX_UNICODE: {
+                int digit = (c >= '0' && c <= '9') ? c - '0' :
+                            (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                            (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+                if (digit < 0) {
+                    return objs_fail(p, "invalid unicode escape");
+                }
+                p->unicode = (p->unicode << 4) | (unsigned)digit;
+                if (++p->unicode_digits == 4) {
+                    objs_append_unicode(p, p->unicode);
+                    p->lex = LEX_STRING;
+                }
+                continue;
+            }
+            case LEX_NUMBER:
+                if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') {
+                    if (p->token_len < sizeof(p->token) - 1) {
+                        p->token[p->token_len++] = c;
+                    }
+                    continue;
+                }
+                if (objs_bare_end(p) != 0) {
+                    return -1;
+                }
+                p->lex = LEX_NONE;
+                break;
+            case LEX_LITERAL:
+                if (c >= 'a' && c <= 'z') {
+                    if (p->token_len < sizeof(p->token) - 1) {
+                        p->token[p->token_len++] = c;
+                    }
+                    continue;
+                }
+                if (objs_bare_end(p) != 0) {
+                    return -1;
+                }
+                p->lex = LEX_NONE;
+                break;
+            default:
+                break;
+        }
+        
+        if (objs_structural(p, c) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to check that the whole listing was received and understood
+int objs_parser_finish(struct objs_parser* p) {
+    if (p->error) {
+        return -1;
+    }
+    if (p->lex != LEX_NONE || p->depth != 0 || p->expect_top != EXPECT_NOTHING) {
+        return objs_fail(p, "truncated listing");
+    }
+    if (!p->saw_dirs) {
+        fprintf(stderr, "No 'dirs' array found in JSON\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to move the bytes held in memory on to the temporary file of a listing cache buffer
+int listing_buffer_spill(struct listing_buffer* buf) {
+    if (!buf->spill) {
+        buf->spill = tmpfile();
+        if (!buf->spill) {
+            return -1;
+        }
+    }
+    if (fwrite(buf->data, 1, buf->len, buf->spill) != buf->len) {
+        return -1;
+    }
+    buf->spilled += buf->len;
+    buf->len = 0;
+    return 0;
+}
+
+// Function to append bytes to a listing cache buffer, keeping at most LISTING_MEMORY_MAX of them in memory
+int listing_buffer_append(struct listing_buffer* buf, const void* data, size_t len) {
+    // Past the cap what is held goes to the temporary file, and a chunk too big for memory follows it there
+    if (buf->len + len > LISTING_MEMORY_MAX) {
+        if (listing_buffer_spill(buf) != 0) {
+            return -1;
+        }
+        if (len > LISTING_MEMORY_MAX) {
+            if (fwrite(data, 1, len, buf->spill) != len) {
+                return -1;
+            }
+            buf->spilled += len;
+            return 0;
+        }
+    }
+    if (buf->len + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity * 2 : 65536;
+        while (capacity < buf->len + len) {
+            capacity *= 2;
+        }
+        char* grown = realloc(buf->data, capacity);
+        if (!grown) {
+            return -1;
+        }
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+// Function to tell how many bytes a listing cache buffer holds
+uint64_t listing_buffer_size(const struct listing_buffer* buf) {
+    return buf->spilled + buf->len;
+}
+
+// Function to hand the bytes of a listing cache buffer to fn in order, the spilled ones a chunk at a time.
+// Stops at the first chunk fn fails.
+int listing_buffer_each(struct listing_buffer* buf, int (*fn)(void* ctx, const char* data, size_t len), void* ctx) {
+    if (buf->spilled > 0) {
+        char* chunk = malloc(LISTING_CHUNK);
+        int rc = chunk && fflush(buf->spill) == 0 && fseek(buf->spill, 0, SEEK_SET) == 0 ? 0 : -1;
+        for (uint64_t left = buf->spilled; rc == 0 && left > 0; ) {
+            size_t n = left < LISTING_CHUNK ? (size_t)left : LISTING_CHUNK;
+            rc = fread(chunk, 1, n, buf->spill) == n ? fn(ctx, chunk, n) : -1;
+            left -= n;
+        }
+        free(chunk);
+        if (rc != 0 || fseek(buf->spill, 0, SEEK_END) != 0) {
+            return -1;
+        }
+    }
+    return buf->len > 0 ? fn(ctx, buf->data, buf->len) : 0;
+}
+
+// Function to release a listing cache buffer
+void listing_buffer_free(struct listing_buffer* buf) {
+    free(buf->data);
+    if (buf->spill) {
+        fclose(buf->spill);
+    }
+    memset(buf, 0, sizeof(*buf));
+}
+
+// Function to append a directory or file entry of the listing to the cache records
+int listing_record_add(struct listing_buffer* records, int is_dir, const char* name, size_t name_len,
+                       uint64_t taken, uint64_t size) {
+    struct listing_record rec = {0};
+    rec.size = size;
+    rec.taken = taken;
+    rec.is_dir = (uint8_t)is_dir;
+    rec.name_len = (uint8_t)name_len;
+    if (listing_buffer_append(records, &rec, sizeof(rec)) != 0 ||
+        listing_buffer_append(records, name, rec.name_len) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to copy a string into the photo list arena, storing its offset
+int photo_list_store(struct photo_list* list, const char* str, uint32_t* offset) {
+    size_t len = strlen(str) + 1;
+    
+    if (list->arena_len + len > list->arena_capacity) {
+        size_t capacity = list->arena_capacity ? list->arena_capacity * 2 : 4096;
+        while (capacity < list->arena_len + len) {
+            capacity *= 2;
+        }
+        if (capacity > UINT32_MAX) {
+            return -1;
+        }
+        char* grown = realloc(list->arena, capacity);
+        if (!grown) {
+            return -1;
+        }
+        list->arena = grown;
+        list->arena_capacity = capacity;
+    }
+    
+    memcpy(list->arena + list->arena_len, str, len);
+    *offset = (uint32_t)list->arena_len;
+    list->arena_len += len;
+    return 0;
+}
+
+// Function to get the name of a photo record
+const char* photo_name(const struct photo_list* list, const struct photo* p) {
+    return list->arena + p->name;
+}
+
+// Function to get the directory tag of a photo record
+const char* photo_tag(const struct photo_list* list, const struct photo* p) {
+    return list->arena + list->tags[p->tag];
+}
+
+// Function to get the capture time of a photo packed as YYYYMMDDhhmmss, 0 when unknown
+uint64_t photo_taken(const struct photo* p) {
+    return p->dated ? (uint64_t)p->date * 1000000ULL + p->time : 0;
+}
+
+// Function to free the records and strings of a photo list
+void photo_list_free(struct photo_list* list) {
+    free(list->order);
+    free(list->photos);
+    free(list->arena);
+    free(list->tags);
+}
+
+// Function to take note of the directory the following files belong to.
+// Each tag is stored once, however many files the directory holds.
+int photo_list_dir(void* ctx, const char* raw_tag) {
+    struct photo_list* list = ctx;
+    char tag[MAX_TAG];
+    
+    size_t len = sanitize_copy(tag, sizeof(tag), raw_tag);
+    if (list->records && listing_record_add(list->records, 1, tag, len, 0, 0) != 0) {
+        return -1;
+    }
+    
+    for (int i = 0; i < list->tag_count; i++) {
+        if (strcmp(list->arena + list->tags[i], tag) == 0) {
+            list->current_tag = i;
+            return 0;
+        }
+    }
+    
+    if (list->tag_count >= list->tag_capacity) {
+        if (list->tag_capacity > UINT16_MAX / 2) {
+            return -1;
+        }
+        int capacity = list->tag_capacity ? list->tag_capacity * 2 : 16;
+        uint32_t* grown = realloc(list->tags, capacity * sizeof(uint32_t));
+        if (!grown) {
+            return -1;
+        }
+        list->tags = grown;
+        list->tag_capacity = capacity;
+    }
+    if (photo_list_store(list, tag, &list->tags[list->tag_count]) != 0) {
+        return -1;
+    }
+    list->current_tag = list->tag_count++;
+    return 0;
+}
+
+// Function to check an entry against -F, --files-from and -f
+int photo_list_wanted(const struct photo_list* list, const char* file_name) {
+    const char* tag = list->tag_count ? list->arena + list->tags[list->current_tag] : "";
+    return !(list->names && !name_set_contains(list->names, tag, file_name)) &&
+           !(list->format && !matches_format(file_name, list->format));
+}
+
+// Function to add a wanted entry to the photo list.
+// With a watermark, entries at or below it are dropped before anything is copied or allocated.
+int photo_list_add(struct photo_list* list, const char* file_name, uint64_t taken, uint64_t size) {
+    // Drop photos that an earlier incremental run already covered
+    if (list->mark &&
+        watermark_compare(taken, list->arena + list->tags[list->current_tag], file_name, list->mark) <= 0) {
+        list->below_mark++;
+        return 0;
+    }
+    
+    if (list->count >= list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 100;
+        struct photo* grown = realloc(list->photos, capacity * sizeof(struct photo));
+        if (!grown) {
+            return -1;
+        }
+        list->photos = grown;
+        list->capacity = capacity;
+    }
+    
+    struct photo* p = &list->photos[list->count];
+    if (photo_list_store(list, file_name, &p->name) != 0) {
+        return -1;
+    }
+    p->tag = (uint16_t)list->current_tag;
+    p->size = size;
+    p->outcome = OUTCOME_NONE;
+    
+    // Date from the "d" field, falling back to the current date
+    if (taken) {
+        p->date = (uint32_t)(taken / 1000000ULL);
+        p->time = (uint32_t)(taken % 1000000ULL);
+        p->dated = 1;
+    } else {
+        p->date = list->today;
+        p->time = 0;
+        p->dated = 0;
+    }
+    
+    list->count++;
+    return 0;
+}
+
+// Function to turn a parsed listing entry into a photo record
+int photo_list_file(void* ctx, const char* raw_name, const char* raw_date, uint64_t size) {
+    struct photo_list* list = ctx;
+    char file_name[MAX_FILENAME];
+    
+    // Skip if filename becomes empty after sanitization
+    size_t len = sanitize_copy(file_name, sizeof(file_name), raw_name);
+    if (len == 0) {
+        return 0;
+    }
+    
+    // Apply -F, --files-from and -f here, so entries nobody asked for cost neither a date parse nor any storage.
+    // The listing cache still keeps them: a later run may filter differently.
+    int wanted = photo_list_wanted(list, file_name);
+    if (!wanted && !list->records) {
+        list->filtered++;
+        return 0;
+    }
+    uint64_t taken = raw_date ? parse_timestamp(raw_date) : 0;
+    if (list->records && listing_record_add(list->records, 0, file_name, len, taken, size) != 0) {
+        return -1;
+    }
+    if (!wanted) {
+        list->filtered++;
+        return 0;
+    }
+    return photo_list_add(list, file_name, taken, size);
+}
+
+// Function to fill the photo list from a run of cached listing records, applying the filters of this run.
+// A record cut off at the end is left for the next run, which starts at *used.
+int photo_list_replay(struct photo_list* list, const char* records, size_t len, size_t* used) {
+    char name[MAX_FILENAME];
+    struct listing_record rec;
+    size_t pos = 0;
+    
+    while (pos + sizeof(rec) <= len) {
+        memcpy(&rec, records + pos, sizeof(rec));
+        if (pos + sizeof(rec) + rec.name_len > len) {
+            break;
+        }
+        pos += sizeof(rec);
+        memcpy(name, records + pos, rec.name_len);
+        name[rec.name_len] = '\0';
+        pos += rec.name_len;
+        
+        int rc = 0;
+        if (rec.is_dir) {
+            rc = photo_list_dir(list, name);
+        } else if (photo_list_wanted(list, name)) {
+            rc = photo_list_add(list, name, rec.taken, rec.size);
+        } else {
+            list->filtered++;
+        }
+        if (rc != 0) {
+            return -1;
+        }
+    }
+    *used = pos;
+    return 0;
+}
+
+// Function to count the photos that may be handed to the downloads now
+int photo_list_ready(const struct photo_list* list) {
+    if (list->ordered && !list->scheduled) {
+        return 0;
+    }
+    return list->count - list->next;
+}
+
+// Function to compare priority entries by key
+int priority_compare(const void* a, const void* b) {
+    return strcmp(((const struct priority_entry*)a)->key, ((const struct priority_entry*)b)->key);
+}
+
+// Function to load a priority list, one NAME or TAG/NAME per line; blank lines and # comments are skipped
+int priority_load(struct priority_list* priority, const char* path) {
+    FILE* fp = fopen(path, "r");
+    char line[MAX_TAG + MAX_FILENAME];
+    int capacity = 0;
+    
+    priority->entries = NULL;
+    priority->count = 0;
+    if (!fp) {
+        fprintf(stderr, "Cannot open priority list %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    
+    while (fgets(line, sizeof(line), fp)) {
+        size_t len = strcspn(line, "\r\n");
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) {
+            len--;
+        }
+        line[len] = '\0';
+        char* key = line + strspn(line, " \t");
+        if (*key == '\0' || *key == '#') {
+            continue;
+        }
+        
+        if (priority->count >= capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct priority_entry* grown = realloc(priority->entries, capacity * sizeof(struct priority_entry));
+            if (!grown) {
+                break;
+            }
+            priority->entries = grown;
+        }
+        struct priority_entry* e = &priority->entries[priority->count];
+        e->key = strdup(key);
+        if (!e->key) {
+            break;
+        }
+        e->rank = priority->count++;
+    }
+    
+    int failed = !feof(fp);
+    fclose(fp);
+    if (failed) {
+        fprintf(stderr, "Cannot read priority list %s\n", path);
+        return -1;
+    }
+    qsort(priority->entries, priority->count, sizeof(struct priority_entry), priority_compare);
+    return 0;
+}
+
+// Function to find the rank of a photo in the priority list, INT_MAX when it is not listed
+int priority_rank(const struct priority_list* priority, const char* tag, const char* name) {
+    char key[MAX_TAG + MAX_FILENAME];
+    struct priority_entry probe = { key, 0 };
+    struct priority_entry* found;
+    
+    snprintf(key, sizeof(key), "%s/%s", tag, name);
+    found = bsearch(&probe, priority->entries, priority->count, sizeof(struct priority_entry), priority_compare);
+    if (!found) {
+        probe.key = (char*)name;
+        found = bsearch(&probe, priority->entries, priority->count, sizeof(struct priority_entry), priority_compare);
+    }
+    return found ? found->rank : INT_MAX;
+}
+
+// Function to release a priority list
+void priority_free(struct priority_list* priority) {
+    for (int i = 0; i < priority->count; i++) {
+        free(priority->entries[i].key);
+    }
+    free(priority->entries);
+    priority->entries = NULL;
+    priority->count = 0;
+}
+
+// Function to hash a name set key (FNV-1a), over TAG/NAME when tag is not NULL
+uint64_t name_set_hash(const char* tag, const char* name) {
+    uint64_t h = 14695981039346656037ULL;
+    if (tag) {
+        for (const char* p = tag; *p; p++) {
+            h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+        }
+        h = (h ^ '/') * 1099511628211ULL;
+    }
+    for (const char* p = name; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Function to find the slot of TAG/NAME, or of NAME when tag is NULL, or the free slot where it belongs
+size_t name_set_slot(const struct name_set* set, const char* tag, const char* name) {
+    size_t mask = set->capacity - 1;
+    size_t tag_len = tag ? strlen(tag) : 0;
+    size_t i = (size_t)name_set_hash(tag, name) & mask;
+    
+    while (set->keys[i]) {
+        const char* key = set->keys[i];
+        if (tag ? strncmp(key, tag, tag_len) == 0 && key[tag_len] == '/' && strcmp(key + tag_len + 1, name) == 0
+                : strcmp(key, name) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Function to add a NAME or TAG/NAME key to a name set; a key given twice is kept once
+int name_set_add(struct name_set* set, const char* key) {
+    // Keep the load factor below one half
+    if ((size_t)(set->count + 1) * 2 > set->capacity) {
+        size_t old_capacity = set->capacity;
+        char** old = set->keys;
+        set->capacity = old_capacity ? old_capacity * 2 : 64;
+        set->keys = calloc(set->capacity, sizeof(char*));
+        if (!set->keys) {
+            set->keys = old;
+            set->capacity = old_capacity;
+            return -1;
+        }
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i]) {
+                set->keys[name_set_slot(set, NULL, old[i])] = old[i];
+            }
+        }
+        free(old);
+    }
+    
+    size_t slot = name_set_slot(set, NULL, key);
+    if (!set->keys[slot]) {
+        set->keys[slot] = strdup(key);
+        if (!set->keys[slot]) {
+            return -1;
+        }
+        set->count++;
+    }
+    return 0;
+}
+
+// Function to load the photos to import, one NAME or TAG/NAME per line; blank lines and # comments are skipped.
+// The tag and name are sanitized like the listing entries they are matched against.
+int name_set_load(struct name_set* set, const char* path) {
+    FILE* fp = fopen(path, "r");
+    char line[MAX_TAG + MAX_FILENAME];
+    char key[MAX_TAG + MAX_FILENAME];
+    char tag[MAX_TAG];
+    char name[MAX_FILENAME];
+    int line_number = 0;
+    
+    if (!fp) {
+        fprintf(stderr, "Cannot open file list %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    
+    int failed = 0;
+    while (!failed && fgets(line, sizeof(line), fp)) {
+        line_number++;
+        size_t len = strcspn(line, "\r\n");
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) {
+            len--;
+        }
+        line[len] = '\0';
+        char* entry = line + strspn(line, " \t");
+        if (*entry == '\0' || *entry == '#') {
+            continue;
+        }
+        
+        char* slash = strchr(entry, '/');
+        if (slash) {
+            *slash = '\0';
+            size_t tag_len = sanitize_copy(tag, sizeof(tag), entry);
+            size_t name_len = sanitize_copy(name, sizeof(name), slash + 1);
+            *slash = '/';
+            if (tag_len == 0 || name_len == 0) {
+                fprintf(stderr, "Warning: %s:%d: skipping '%s', its tag or name is empty after sanitization\n",
+                        path, line_number, entry);
+                continue;
+            }
+            snprintf(key, sizeof(key), "%s/%s", tag, name);
+        } else if (sanitize_copy(key, sizeof(key), entry) == 0) {
+            fprintf(stderr, "Warning: %s:%d: skipping '%s', nothing is left of it after sanitization\n",
+                    path, line_number, entry);
+            continue;
+        }
+        if (strcmp(key, entry) != 0) {
+            fprintf(stderr, "Warning: %s:%d: '%s' is looked up as '%s'\n", path, line_number, entry, key);
+        }
+        failed = name_set_add(set, key) != 0;
+    }
+    
+    failed = failed || !feof(fp);
+    fclose(fp);
+    if (failed) {
+        fprintf(stderr, "Cannot read file list %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to tell whether a photo is in a name set, by TAG/NAME or by NAME alone
+int name_set_contains(const struct name_set* set, const char* tag, const char* name) {
+    if (set->count == 0) {
+        return 0;
+    }
+    return set->keys[name_set_slot(set, tag, name)] != NULL || set->keys[name_set_slot(set, NULL, name)] != NULL;
+}
+
+// Function to release a name set
+void name_set_free(struct name_set* set) {
+    for (size_t i = 0; i < set->capacity; i++) {
+        free(set->keys[i]);
+    }
+    free(set->keys);
+    set->keys = NULL;
+    set->capacity = 0;
+    set->count = 0;
+}
+
+// Function to order schedule keys: priority rank, then the policy key, then listing position
+int schedule_compare(const void* a, const void* b) {
+    const struct schedule_key* x = a;
+    const struct schedule_key* y = b;
+    if (x->rank != y->rank) {
+        return x->rank < y->rank ? -1 : 1;
+    }
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Function to compute the ascending sort key of a photo under a policy
+uint64_t schedule_key(const struct photo_list* list, const struct photo* p, int policy) {
+    switch (policy) {
+        case ORDER_NEWEST:
+            // Photos without a capture time go last
+            return UINT64_MAX - photo_taken(p);
+        case ORDER_JPG_FIRST:
+            return matches_format(photo_name(list, p), "jpg") ? 0 : 1;
+        case ORDER_SMALLEST:
+            // Photos of unknown size go last
+            return p->size ? p->size : UINT64_MAX;
+        default:
+            return 0;
+    }
+}
+
+// Function to fix the dispatch order of the queued photos once the listing is in.
+// Photos already handed out keep their place; without memory the listing order is used.
+void photo_list_schedule(struct photo_list* list) {
+    int queued = list->count - list->next;
+    
+    list->scheduled = 1;
+    if (queued <= 0) {
+        return;
+    }
+    
+    struct schedule_key* keys = malloc(queued * sizeof(struct schedule_key));
+    list->order = malloc(list->count * sizeof(int));
+    if (!keys || !list->order) {
+        fprintf(stderr, "Warning: not enough memory to order downloads, using listing order\n");
+        free(keys);
+        free(list->order);
+        list->order = NULL;
+        return;
+    }
+    
+    for (int i = 0; i < queued; i++) {
+        const struct photo* p = &list->photos[list->next + i];
+        keys[i].rank = list->priority ? priority_rank(list->priority, photo_tag(list, p), photo_name(list, p)) : INT_MAX;
+        keys[i].key = schedule_key(list, p, list->policy);
+        keys[i].index = list->next + i;
+    }
+    qsort(keys, queued, sizeof(struct schedule_key), schedule_compare);
+    
+    for (int i = 0; i < list->next; i++) {
+        list->order[i] = i;
+    }
+    for (int i = 0; i < queued; i++) {
+        list->order[list->next + i] = keys[i].index;
+    }
+    free(keys);
+}
+
+// Function to build the tag a photo is indexed under; photos of a labelled camera are kept apart
+const char* camera_index_tag(const struct camera* cam, const char* tag, char* out, size_t size) {
+    if (cam->label[0] == '\0') {
+        return tag;
+    }
+    snprintf(out, size, "%s/%s", cam->label, tag);
+    return out;
+}
+
+// Function to record the final outcome of a photo, in the import index when it succeeded
+void record_outcome(struct import_index* index, struct camera* cam, int i, int ok, uint64_t size, uint64_t content) {
+    struct photo_list* list = &cam->listing.list;
+    struct photo* p = &list->photos[i];
+    char tag[MAX_TAG];
+    if (ok && index) {
+        index_add(index, camera_index_tag(cam, photo_tag(list, p), tag, sizeof(tag)), photo_name(list, p), p->date, size, content);
+    }
+    p->outcome = ok ? OUTCOME_DONE : OUTCOME_FAILED;
+}
+
+// Function to read the fingerprint of the cached listing of a camera; its records are read only when reused
+void listing_cache_open(struct listing_cache* cache, const char* base_path, const char* label) {
+    char magic[sizeof(LISTING_MAGIC) - 1];
+    
+    if (label[0] != '\0') {
+        snprintf(cache->path, sizeof(cache->path), "%s/%s.%s", base_path, LISTING_FILENAME, label);
+    } else {
+        snprintf(cache->path, sizeof(cache->path), "%s/%s", base_path, LISTING_FILENAME);
+    }
+    xxh64_init(&cache->hash);
+    
+    FILE* fp = fopen(cache->path, "rb");
+    if (!fp) {
+        return;
+    }
+    cache->loaded = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+                    memcmp(magic, LISTING_MAGIC, sizeof(magic)) == 0 &&
+                    fread(&cache->cached, sizeof(cache->cached), 1, fp) == 1;
+    cache->cached.etag[MAX_VALIDATOR - 1] = '\0';
+    cache->cached.last_modified[MAX_VALIDATOR - 1] = '\0';
+    fclose(fp);
+}
+
+// Function to ask the camera for the listing only if it changed since the cached one
+void listing_cache_prepare(struct listing_cache* cache, CURL* curl) {
+    char header[MAX_VALIDATOR + 32];
+    
+    if (!cache->loaded) {
+        return;
+    }
+    if (cache->cached.etag[0] != '\0') {
+        snprintf(header, sizeof(header), "If-None-Match: %s", cache->cached.etag);
+        cache->headers = curl_slist_append(cache->headers, header);
+    }
+    if (cache->cached.last_modified[0] != '\0') {
+        snprintf(header, sizeof(header), "If-Modified-Since: %s", cache->cached.last_modified);
+        cache->headers = curl_slist_append(cache->headers, header);
+    }
+    if (cache->headers) {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, cache->headers);
+    }
+}
+
+// Function to copy a response header into a validator, leaving it empty when missing or too long
+void listing_cache_validator(CURL* curl, const char* name, char* out) {
+    struct curl_header* h;
+    
+    out[0] = '\0';
+    if (curl_easy_header(curl, name, 0, CURLH_HEADER, -1, &h) == CURLHE_OK && strlen(h->value) < MAX_VALIDATOR) {
+        memcpy(out, h->value, strlen(h->value) + 1);
+    }
+}
+
+// Function to fingerprint the response once its headers are in. A body without validators but of the
+// cached length is most likely the cached listing again, so parsing waits until its hash is known.
+void listing_cache_check(struct listing* listing) {
+    struct listing_cache* cache = &listing->cache;
+    curl_off_t length = -1;
+    
+    cache->checked = 1;
+    listing_cache_validator(listing->curl, "ETag", cache->fresh.etag);
+    listing_cache_validator(listing->curl, "Last-Modified", cache->fresh.last_modified);
+    curl_easy_getinfo(listing->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    cache->deferred = cache->loaded && cache->fresh.etag[0] == '\0' && cache->fresh.last_modified[0] == '\0' &&
+                      length >= 0 && (uint64_t)length == cache->cached.body_len;
+}
+
+// Function to read the cached records into the photo list a chunk at a time. They are hashed in a first
+// pass, so a damaged cache puts no photo on the list.
+int listing_cache_replay(struct listing* listing) {
+    struct listing_cache* cache = &listing->cache;
+    uint64_t len = cache->cached.records_len;
+    long start = (long)(sizeof(LISTING_MAGIC) - 1 + sizeof(cache->cached));
+    struct xxh64 hash;
+    
+    char* chunk = malloc(LISTING_CHUNK);
+    FILE* fp = fopen(cache->path, "rb");
+    int rc = chunk && fp && fseek(fp, start, SEEK_SET) == 0 ? 0 : -1;
+    xxh64_init(&hash);
+    for (uint64_t left = len; rc == 0 && left > 0; ) {
+        size_t n = left < LISTING_CHUNK ? (size_t)left : LISTING_CHUNK;
+        if (fread(chunk, 1, n, fp) != n) {
+            rc = -1;
+        }
+        xxh64_update(&hash, chunk, n);
+        left -= n;
+    }
+    if (rc == 0 && (xxh64_digest(&hash) != cache->cached.records_hash || fseek(fp, start, SEEK_SET) != 0)) {
+        rc = -1;
+    }
+    
+    // The records of this run are the cached ones, nothing needs to be kept again
+    listing->list.records = NULL;
+    if (rc == 0) {
+        double started = now_seconds();
+        size_t have = 0;
+        for (uint64_t left = len; rc == 0 && left > 0; ) {
+            size_t n = LISTING_CHUNK - have < left ? LISTING_CHUNK - have : (size_t)left;
+            size_t used = 0;
+            if (fread(chunk + have, 1, n, fp) != n || photo_list_replay(&listing->list, chunk, have + n, &used) != 0) {
+                rc = -1;
+            }
+            have += n - used;
+            memmove(chunk, chunk + used, have);
+            left -= n;
+        }
+        if (have > 0) {
+            rc = -1;
+        }
+        listing->parse_seconds += now_seconds() - started;
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    free(chunk);
+    
+    // A damaged cache must not stand in for the listing again
+    if (rc != 0) {
+        fprintf(stderr, "Warning: discarding damaged listing cache %s\n", cache->path);
+        unlink(cache->path);
+    }
+    return rc;
+}
+
+// Function to parse a chunk of a listing body that was held back
+int listing_parse_chunk(void* ctx, const char* data, size_t len) {
+    return objs_parser_feed(ctx, data, len);
+}
+
+// Function to settle the listing once the response is complete. The cached records stand in for it when
+// the camera answered 304 or sent the cached body again; a body held back is parsed when it changed.
+// Returns -1 when the listing cannot be used.
+int listing_cache_settle(struct listing* listing) {
+    struct listing_cache* cache = &listing->cache;
+    long response_code = 0;
+    
+    curl_easy_getinfo(listing->curl, CURLINFO_RESPONSE_CODE, &response_code);
+    if (response_code == 304 ||
+        (cache->deferred && listing_buffer_size(&cache->body) == cache->cached.body_len &&
+         xxh64_digest(&cache->hash) == cache->cached.body_hash)) {
+        if (!cache->loaded || listing_cache_replay(listing) != 0) {
+            return -1;
+        }
+        cache->reused = 1;
+        return 0;
+    }
+    if (!cache->deferred) {
+        return 0;
+    }
+    
+    cache->deferred = 0;
+    double started = now_seconds();
+    int rc = listing_buffer_each(&cache->body, listing_parse_chunk, &listing->parser);
+    listing->parse_seconds += now_seconds() - started;
+    return rc;
+}
+
+// Function to hash a chunk of the listing cache records
+int listing_hash_chunk(void* ctx, const char* data, size_t len) {
+    xxh64_update(ctx, data, len);
+    return 0;
+}
+
+// Function to write a chunk of the listing cache to its file
+int listing_write_chunk(void* ctx, const char* data, size_t len) {
+    return fwrite(data, 1, len, ctx) == len ? 0 : -1;
+}
+
+// Function to store the listing of this run for the next one, replacing the cache atomically
+void listing_cache_save(struct listing_cache* cache) {
+    char tmp_path[MAX_FILEPATH + 8];
+    struct xxh64 records_hash;
+    
+    xxh64_init(&records_hash);
+    if (listing_buffer_each(&cache->records, listing_hash_chunk, &records_hash) != 0) {
+        fprintf(stderr, "Warning: cannot update listing cache %s\n", cache->path);
+        return;
+    }
+    cache->fresh.body_len = listing_buffer_size(&cache->body);
+    cache->fresh.body_hash = xxh64_digest(&cache->hash);
+    cache->fresh.records_len = listing_buffer_size(&cache->records);
+    cache->fresh.records_hash = xxh64_digest(&records_hash);
+    
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache->path);
+    FILE* fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Warning: cannot write listing cache %s: %s\n", tmp_path, strerror(errno));
+        return;
+    }
+    int ok = fwrite(LISTING_MAGIC, 1, sizeof(LISTING_MAGIC) - 1, fp) == sizeof(LISTING_MAGIC) - 1 &&
+             fwrite(&cache->fresh, sizeof(cache->fresh), 1, fp) == 1 &&
+             listing_buffer_each(&cache->records, listing_write_chunk, fp) == 0 &&
+             listing_buffer_each(&cache->body, listing_write_chunk, fp) == 0;
+    if (fclose(fp) != 0 || !ok || rename(tmp_path, cache->path) != 0) {
+        fprintf(stderr, "Warning: cannot update listing cache %s\n", cache->path);
+        unlink(tmp_path);
+    }
+}
+
+// Function to release what the listing cache holds for this run
+void listing_cache_free(struct listing_cache* cache) {
+    listing_buffer_free(&cache->body);
+    listing_buffer_free(&cache->records);
+    curl_slist_free_all(cache->headers);
+    cache->headers = NULL;
+}
+
+// Function to prepare the listing request on its own handle
+void listing_prepare(struct listing* listing, const char* url) {
+    session_prepare(listing->curl, url);
+    listing_cache_prepare(&listing->cache, listing->curl);
+    
+    // Set callback function to handle response data
+    curl_easy_setopt(listing->curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(listing->curl, CURLOPT_WRITEDATA, listing);
+    
+    // The listing may sit paused behind a full queue, so only abort it when it stops moving
+    curl_easy_setopt(listing->curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(listing->curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(listing->curl, CURLOPT_LOW_SPEED_TIME, 30L);
+    curl_easy_setopt(listing->curl, CURLOPT_FAILONERROR, 1L);
+}
+
+// Function to wrap up the listing transfer once it is done
+void listing_finish(struct transfer_session* session, struct camera* cam, CURLcode res) {
+    struct listing* listing = &cam->listing;
+    const char* label = cam->label;
+    const char* sep = label[0] ? ": " : "";
+    
+    curl_multi_remove_handle(session->multi, listing->curl);
+    session_count_connections(session, listing->curl);
+    curl_off_t bytes = 0;
+    curl_easy_getinfo(listing->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    listing->bytes = (uint64_t)bytes;
+    listing->seconds = transfer_time(listing->curl, CURLINFO_TOTAL_TIME_T);
+    listing->ttfb = transfer_time(listing->curl, CURLINFO_STARTTRANSFER_TIME_T);
+    listing->connect = transfer_time(listing->curl, CURLINFO_CONNECT_TIME_T);
+    listing->running = 0;
+    listing->paused = 0;
+    TRACE_SPAN("listing", cam->url, listing->track, trace_now() - listing->seconds, trace_now());
+    
+    // An unchanged listing comes from the cache, a body held back for the comparison is parsed now
+    int settled = res == CURLE_OK ? listing_cache_settle(listing) : 0;
+    
+    // Whatever part of the listing arrived can be ordered and fetched now
+    if (listing->list.ordered) {
+        photo_list_schedule(&listing->list);
+    }
+    
+    // Check for errors
+    if (res != CURLE_OK || settled != 0) {
+        if (listing->parser.error) {
+            fprintf(stderr, "%s%sFailed to parse JSON response\n", label, sep);
+        } else if (res != CURLE_OK) {
+            fprintf(stderr, "%s%sFailed to fetch photo list: %s\n", label, sep, curl_easy_strerror(res));
+        } else {
+            fprintf(stderr, "%s%sFailed to read the cached photo list\n", label, sep);
+        }
+        listing_cache_free(&listing->cache);
+        return;
+    }
+    if (!listing->cache.reused && objs_parser_finish(&listing->parser) != 0) {
+        fprintf(stderr, "%s%sFailed to parse JSON response\n", label, sep);
+        listing_cache_free(&listing->cache);
+        return;
+    }
+    
+    listing->complete = 1;
+    if (listing->cache.reused) {
+        printf("%s%sListing unchanged since the last run, reusing the cached records\n", label, sep);
+    } else if (listing->list.records) {
+        listing_cache_save(&listing->cache);
+    }
+    listing_cache_free(&listing->cache);
+    printf("%s%sFound %d photos matching criteria\n", label, sep, listing->list.count);
+    if (listing->list.filtered) {
+        printf("%s%sFiltered out %d photos by name or format\n", label, sep, listing->list.filtered);
+    }
+    if (listing->list.mark) {
+        printf("%s%sSkipped %d photos at or below the import watermark\n", label, sep, listing->list.below_mark);
+    }
+}
+
+// Function to check that an imported photo is still on disk with the size it was imported with.
+// A photo dropped as a duplicate has no file of its own; its content belongs to another entry.
+int imported_file_intact(const struct transfer_session* session, const struct import_index* index, const char* base_path,
+                         const struct camera* cam, uint32_t date, const char* name, const struct index_entry* known) {
+    char path[MAX_FILEPATH];
+    struct stat st;
+    
+    const char* owner = index_find_content(index, known->content, known->size);
+    if (owner && owner != known->key) {
+        return 1;
+    }
+    if (format_photo_path(session, base_path, date, cam->label, name, "", path, sizeof(path)) != 0) {
+        return 1;
+    }
+    if (stat(path, &st) == 0 && (known->size == 0 || (uint64_t)st.st_size == known->size)) {
+        return 1;
+    }
+    printf("Imported file missing or damaged, fetching it again: %s\n", path);
+    return 0;
+}
+
+// Function to find another file of the open durable batch with the same content
+const struct completed_file* commit_batch_find_content(const struct commit_batch* batch, const struct completed_file* file) {
+    if (file->content == 0) {
+        return NULL;
+    }
+    for (int i = 0; i < batch->count; i++) {
+        const struct completed_file* other = &batch->files[i];
+        if (other != file && !other->duplicate && other->content == file->content && other->size == file->size) {
+            return other;
+        }
+    }
+    return NULL;
+}
+
+// Function to delete a download whose content was already imported under another name,
+// such as the same shot renumbered after the file counter was reset. Returns 1 when it was deleted.
+int file_drop_duplicate(struct transfer_session* session, const struct import_index* index, struct completed_file* file) {
+    if (!index || !session->verify) {
+        return 0;
+    }
+    const struct photo_list* list = &file->camera->listing.list;
+    const struct photo* p = &list->photos[file->photo_index];
+    char tag[MAX_TAG];
+    const char* key = index_find_content(index, file->content, file->size);
+    const char* key_name;
+    if (key) {
+        // The same photo fetched again after its file went missing is no duplicate
+        key_name = key + strlen(key) + 1;
+        if (strcmp(key, camera_index_tag(file->camera, photo_tag(list, p), tag, sizeof(tag))) == 0 &&
+            strcmp(key_name, photo_name(list, p)) == 0) {
+            return 0;
+        }
+    } else {
+        // The files of the open durable batch only go into the index once it commits
+        const struct completed_file* other = commit_batch_find_content(&session->batch, file);
+        if (!other) {
+            return 0;
+        }
+        const struct photo_list* other_list = &other->camera->listing.list;
+        const struct photo* q = &other_list->photos[other->photo_index];
+        key = camera_index_tag(other->camera, photo_tag(other_list, q), tag, sizeof(tag));
+        key_name = photo_name(other_list, q);
+    }
+    
+    // A file waiting for its durable batch is still under its temporary name
+    const char* suffix = session->commit_files > 0 ? PART_SUFFIX : "";
+    char path[MAX_FILEPATH + sizeof(PART_SUFFIX)];
+    for (int t = 0; t < session->target_count; t++) {
+        snprintf(path, sizeof(path), "%s%s", file->filepath[t], suffix);
+        if ((file->targets & (1 << t)) && unlink(path) != 0 && t == 0) {
+            perror("unlink");
+            return 0;
+        }
+    }
+    printf("Duplicate of %s/%s, not kept: %s\n", key, key_name, file->filepath[0]);
+    session->duplicates++;
+    file->duplicate = 1;
+    return 1;
+}
+
+// Function to upgrade the cached preview of a photo that was just imported in full. The photo is linked
+// into the cache under its own name, so the cache shows it at full resolution without taking more space.
+void preview_upgrade(const struct transfer_session* session, const struct completed_file* file) {
+    const struct photo_list* list = &file->camera->listing.list;
+    const struct photo* p = &list->photos[file->photo_index];
+    const char* name = photo_name(list, p);
+    char preview[MAX_FILEPATH];
+    char upgraded[MAX_FILEPATH];
+    char linkpath[MAX_FILEPATH + 8];
+    
+    if (!session->preview_dir ||
+        format_photo_path(session, session->preview_dir, p->date, file->camera->label, name,
+                          preview_suffix(name), preview, sizeof(preview)) != 0 ||
+        format_photo_path(session, session->preview_dir, p->date, file->camera->label, name,
+                          "", upgraded, sizeof(upgraded)) != 0 ||
+        access(preview, F_OK) != 0) {
+        return;
+    }
+    
+    // A cache on another filesystem than the photo keeps the preview
+    snprintf(linkpath, sizeof(linkpath), "%s.link", upgraded);
+    unlink(linkpath);
+    if (link(file->filepath[0], linkpath) != 0 || rename(linkpath, upgraded) != 0) {
+        unlink(linkpath);
+        return;
+    }
+    if (strcmp(preview, upgraded) != 0) {
+        unlink(preview);
+    }
+    printf("Preview upgraded to the full photo: %s\n", upgraded);
+}
+
+// Structure for a cached preview considered for eviction
+struct preview_entry {
+    char* path;
+    uint64_t size;
+    double used;    // Modification time, refreshed whenever a preview run finds the preview cached
+};
+
+// Structure for the previews found in the cache
+struct preview_scan {
+    struct preview_entry* entries;
+    size_t count;
+    size_t capacity;
+    uint64_t bytes;
+};
+
+// Function to collect the previews below a cache folder. Upgraded entries are links to imported
+// photos and take no space of their own, so they are left out.
+int preview_scan_dir(struct preview_scan* scan, const char* dir_path, int depth) {
+    DIR* dir = opendir(dir_path);
+    struct dirent* entry;
+    char path[MAX_FILEPATH];
+    
+    if (!dir) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (entry->d_name[0] == '.' ||
+            snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(path) ||
+            lstat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (depth < 3) {
+                preview_scan_dir(scan, path, depth + 1);
+            }
+            continue;
+        }
+        size_t len = strlen(path);
+        if (!S_ISREG(st.st_mode) || st.st_nlink > 1 ||
+            (len > strlen(PART_SUFFIX) && strcmp(path + len - strlen(PART_SUFFIX), PART_SUFFIX) == 0)) {
+            continue;
+        }
+        
+        if (scan->count == scan->capacity) {
+            size_t capacity = scan->capacity ? scan->capacity * 2 : 256;
+            struct preview_entry* grown = realloc(scan->entries, capacity * sizeof(struct preview_entry));
+            if (!grown) {
+                closedir(dir);
+                return -1;
+            }
+            scan->entries = grown;
+            scan->capacity = capacity;
+        }
+        struct preview_entry* e = &scan->entries[scan->count];
+        e->path = strdup(path);
+        if (!e->path) {
+            closedir(dir);
+            return -1;
+        }
+        e->size = (uint64_t)st.st_size;
+        e->used = (double)st.st_mtim.tv_sec + (double)st.st_mtim.tv_nsec / 1e9;
+        scan->count++;
+        scan->bytes += e->size;
+    }
+    closedir(dir);
+    return 0;
+}
+
+// Function to order previews from the least recently used
+int preview_compare(const void* a, const void* b) {
+    const struct preview_entry* x = a;
+    const struct preview_entry* y = b;
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+// Function to evict the least recently used previews until the cache fits its size cap
+void preview_trim(const char* cache_dir, long cap_mb) {
+    struct preview_scan scan = { NULL, 0, 0, 0 };
+    uint64_t cap = (uint64_t)cap_mb * 1024 * 1024;
+    int evicted = 0;
+    
+    if (preview_scan_dir(&scan, cache_dir, 0) != 0) {
+        fprintf(stderr, "Warning: cannot scan the preview cache %s\n", cache_dir);
+    }
+    qsort(scan.entries, scan.count, sizeof(struct preview_entry), preview_compare);
+    for (size_t i = 0; i < scan.count && scan.bytes > cap; i++) {
+        if (unlink(scan.entries[i].path) == 0) {
+            scan.bytes -= scan.entries[i].size;
+            evicted++;
+        }
+    }
+    printf("Preview cache: %zu previews, %.1f of %ld MB, %d evicted\n",
+           scan.count - (size_t)evicted, (double)scan.bytes / (1024.0 * 1024.0), cap_mb, evicted);
+    
+    for (size_t i = 0; i < scan.count; i++) {
+        free(scan.entries[i].path);
+    }
+    free(scan.entries);
+}
+
+// Function to check whether a camera has nothing left to list, queue, retry or download
+int camera_idle(const struct camera* cam) {
+    return !cam->listing.running && cam->listing.list.next >= cam->listing.list.count &&
+           cam->active == 0 && cam->retry_count == 0;
+}
+
+// Function to fill the free download slots of a camera, due retries first, then the next matching photos
+void camera_fill_slots(struct transfer_session* session, struct camera* cam, struct transfer* slots,
+                       struct import_index* index, const struct cli_options* options, const char* base_path,
+                       int* started, double now) {
+    struct photo_list* list = &cam->listing.list;
+    const char* label = cam->label;
+    const char* sep = label[0] ? "/" : "";
+    
+    for (int s = 0; s < session->jobs; s++) {
+        struct transfer* xfer = &slots[s];
+        if (xfer->active) {
+            continue;
+        }
+        if (cam->active >= cam->adapt.limit) {
+            return;
+        }
+        
+        int due = -1;
+        for (int r = 0; r < cam->retry_count; r++) {
+            if (cam->retries[r].due <= now) {
+                due = r;
+                break;
+            }
+        }
+        
+        if (due >= 0) {
+            const struct photo* p = &list->photos[cam->retries[due].index];
+            const char* name = photo_name(list, p);
+            xfer->photo_index = cam->retries[due].index;
+            xfer->attempt = cam->retries[due].attempt;
+            cam->retries[due] = cam->retries[--cam->retry_count];
+            
+            progress_break(&session->progress);
+            printf("Retrying %s%s%s (attempt %d of %d)\n", label, sep, name, xfer->attempt + 1, options->retries + 1);
+            int rc = download_photo(session, xfer, name, photo_tag(list, p), p->date, p->size, base_path);
+            if (rc == 1) {
+                cam->active++;
+            } else {
+                record_outcome(index, cam, xfer->photo_index, rc == 0, 0, 0);
+                if (rc == 0) {
+                    session->skipped_existing++;
+                    cam->downloaded++;
+                }
+            }
+            continue;
+        }
+        
+        while (photo_list_ready(list) > 0) {
+            TRACE_BEGIN(filter_started);
+            int i = list->order ? list->order[list->next] : list->next;
+            list->next++;
+            struct photo* p = &list->photos[i];
+            const char* name = photo_name(list, p);
+            const char* tag = photo_tag(list, p);
+            char index_tag[MAX_TAG];
+            
+            char date_folder[MAX_DATE];
+            format_date_folder(p->date, date_folder);
+            progress_break(&session->progress);
+            printf("Photo %d: %s%s%s, date=%s\n", ++*started, label, sep, name, date_folder);
+            
+            // Skip photos the index already knows about without touching the filesystem,
+            // unless verifying, where the file must still be there in full
+            const struct index_entry* known =
+                index ? index_find(index, camera_index_tag(cam, tag, index_tag, sizeof(index_tag)), name, p->date, p->size) : NULL;
+            if (known && (!session->verify || imported_file_intact(session, index, base_path, cam, p->date, name, known))) {
+                printf("Already imported, skipping: %s%s%s/%s\n", label, sep, tag, name);
+                p->outcome = OUTCOME_DONE;
+                session->skipped_index++;
+                cam->downloaded++;
+                TRACE_END(filter_started, "filter", name, TRACE_SLOT(xfer));
+                continue;
+            }
+            TRACE_END(filter_started, "filter", name, TRACE_SLOT(xfer));
+            
+            xfer->photo_index = i;
+            xfer->attempt = 0;
+            int rc = download_photo(session, xfer, name, tag, p->date, p->size ? p->size : known ? known->size : 0, base_path);
+            if (rc == 1) {
+                cam->active++;
+                break;
+            }
+            
+            // A file already on disk from a run before the index existed gets recorded too
+            record_outcome(index, cam, i, rc == 0, 0, 0);
+            if (rc == 0) {
+                session->skipped_existing++;
+                cam->downloaded++;
+            }
+        }
+    }
+    
+    // A slot left free for lack of work means the window cannot tell whether the limit is right
+    if (cam->active < cam->adapt.limit) {
+        cam->adapt.starved = 1;
+    }
+}
+
+// Function to queue a failed download for another try after its backoff. Returns -1 when it cannot be queued.
+int camera_queue_retry(struct camera* cam, const struct transfer* xfer, const struct cli_options* options) {
+    const char* name = photo_name(&cam->listing.list, &cam->listing.list.photos[xfer->photo_index]);
+    
+    if (cam->retry_count >= cam->retry_capacity) {
+        int capacity = cam->retry_capacity ? cam->retry_capacity * 2 : 16;
+        struct pending_retry* grown = realloc(cam->retries, capacity * sizeof(struct pending_retry));
+        if (!grown) {
+            fprintf(stderr, "Not enough memory to retry %s\n", name);
+            return -1;
+        }
+        cam->retries = grown;
+        cam->retry_capacity = capacity;
+    }
+    
+    // Back off exponentially before trying again
+    double delay = options->retry_delay * (double)(1L << xfer->attempt);
+    if (delay > MAX_RETRY_DELAY) {
+        delay = MAX_RETRY_DELAY;
+    }
+    printf("Will retry %s in %.1f s\n", name, delay);
+    cam->retries[cam->retry_count].index = xfer->photo_index;
+    cam->retries[cam->retry_count].attempt = xfer->attempt + 1;
+    cam->retries[cam->retry_count].due = now_seconds() + delay;
+    cam->retry_count++;
+    return 0;
+}
+
+// Function to start the adaptive window of a camera for a new run. The limit found in the last run is kept.
+void camera_adapt_init(const struct transfer_session* session, struct camera* cam, double now) {
+    struct adaptive* ad = &cam->adapt;
+    int limit = ad->limit;
+    
+    if (!session->adaptive) {
+        limit = session->jobs;
+    } else if (limit == 0) {
+        limit = ADAPT_START < session->jobs ? ADAPT_START : session->jobs;
+    }
+    memset(ad, 0, sizeof(*ad));
+    ad->limit = limit;
+    ad->window_start = now;
+}
+
+// Function to adjust how many transfers a camera keeps in flight, AIMD-style, once per window. The limit
+// grows by one while that still raises throughput and halves when transfers fail. Past the knee, where an
+// increase bought less than ADAPT_MIN_GAIN or requests queue up on the camera and the time to first byte
+// climbs far above the best seen, it steps back by one and holds there for a while before probing again.
+void camera_adapt(struct transfer_session* session, struct camera* cam, double now) {
+    struct adaptive* ad = &cam->adapt;
+    double elapsed = now - ad->window_start;
+    if (elapsed < ADAPT_WINDOW) {
+        return;
+    }
+    
+    double rate = (double)ad->bytes / elapsed;
+    double ttfb = ad->finished ? ad->ttfb_sum / ad->finished : 0;
+    int limit = ad->limit;
+    const char* reason = NULL;
+    
+    if (ad->failures > 0) {
+        limit = limit > 1 ? limit / 2 : 1;
+        ad->hold = ADAPT_HOLD;
+        reason = "transfers failed";
+    } else if (ad->starved) {
+        // Too little work to fill the slots; judge the limit again once the queue is full
+    } else if (!ad->shrank && limit > 1 && ad->best_ttfb > 0 && ttfb > ADAPT_TTFB_FACTOR * ad->best_ttfb) {
+        limit--;
+        ad->hold = ADAPT_HOLD;
+        reason = "first byte slowing down";
+    } else if (ad->grew && rate < ad->last_rate * (1.0 + ADAPT_MIN_GAIN)) {
+        limit--;
+        ad->hold = ADAPT_HOLD;
+        reason = "no gain, stepping back";
+    } else if (ad->hold > 0) {
+        ad->hold--;
+        reason = "holding";
+    } else if (limit < session->jobs) {
+        limit++;
+        reason = "probing";
+    } else {
+        reason = "at the ceiling";
+    }
+    
+    if (reason) {
+        progress_break(&session->progress);
+        printf("Adaptive %s: %d -> %d transfers, %.1f MB/s, first byte %.0f ms (%s)\n",
+               cam->label[0] ? cam->label : cam->url, ad->limit, limit,
+               rate / (1024.0 * 1024.0), ttfb * 1000.0, reason);
+        if (!ad->starved && ttfb > 0 && (ad->best_ttfb == 0 || ttfb < ad->best_ttfb)) {
+            ad->best_ttfb = ttfb;
+        }
+        if (!ad->starved) {
+            ad->last_rate = rate;
+        }
+        ad->increases += limit > ad->limit;
+        ad->decreases += limit < ad->limit;
+        ad->grew = limit > ad->limit;
+        ad->shrank = limit < ad->limit;
+        ad->limit = limit;
+    }
+    
+    ad->window_start = now;
+    ad->bytes = 0;
+    ad->ttfb_sum = 0;
+    ad->finished = 0;
+    ad->failures = 0;
+    ad->starved = 0;
+}
+
+// Function to hand a published file on to the preview cache and post-processing
+void completed_file_hand_on(struct transfer_session* session, struct completed_file* file) {
+    if (file->duplicate) {
+        completed_file_release(file);
+        return;
+    }
+    preview_upgrade(session, file);
+    if (session->post) {
+        post_pool_submit(session->post, file);
+    }
+}
+
+// Function to sync the filesystem of every target once. Returns -1 when one of them fails.
+int session_sync_targets(struct transfer_session* session) {
+    dev_t synced[MAX_TARGETS];
+    int synced_count = 0;
+    int rc = 0;
+    
+    for (int t = 0; t < session->target_count; t++) {
+        struct stat st;
+        int seen = 0;
+        if (stat(session->targets[t].path, &st) != 0) {
+            fprintf(stderr, "Cannot sync %s: %s\n", session->targets[t].path, strerror(errno));
+            rc = -1;
+            continue;
+        }
+        for (int i = 0; i < synced_count; i++) {
+            seen = seen || synced[i] == st.st_dev;
+        }
+        if (seen) {
+            continue;
+        }
+        int fd = open(session->targets[t].path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || syncfs(fd) != 0) {
+            fprintf(stderr, "Cannot sync %s: %s\n", session->targets[t].path, strerror(errno));
+            rc = -1;
+        } else {
+            synced[synced_count++] = st.st_dev;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return rc;
+}
+
+// Function to publish a durable batch. One syncfs per filesystem makes the data of every file durable,
+// the files are renamed to their final names, a second one makes the renames durable, and only then
+// are they reported, written to the import index log and handed on. A crash at any point leaves either
+// temporary files, which are fetched again, or complete files under their final names. When only the
+// second sync fails the files already carry their final names, so they count as published, not yet durable.
+void commit_batch(struct transfer_session* session, struct import_index* index) {
+    struct commit_batch* batch = &session->batch;
+    double started = now_seconds();
+    
+    if (batch->count == 0) {
+        return;
+    }
+    progress_break(&session->progress);
+    
+    int synced = session_sync_targets(session) == 0;
+    for (int i = 0; i < batch->count; i++) {
+        struct completed_file* file = &batch->files[i];
+        for (int t = 0; t < session->target_count && synced && !file->duplicate; t++) {
+            char partpath[MAX_FILEPATH + sizeof(PART_SUFFIX)];
+            if (!(file->targets & (1 << t))) {
+                continue;
+            }
+            snprintf(partpath, sizeof(partpath), "%s" PART_SUFFIX, file->filepath[t]);
+            if (rename(partpath, file->filepath[t]) == 0) {
+                continue;
+            }
+            perror("rename");
+            if (t == 0) {
+                file->targets = 0;
+                break;
+            }
+            unlink(partpath);
+            file->targets &= ~(1 << t);
+            session->targets[t].failed++;
+        }
+    }
+    int durable = synced && session_sync_targets(session) == 0;
+    double took = now_seconds() - started;
+    int published = 0;
+    
+    for (int i = 0; i < batch->count; i++) {
+        struct completed_file* file = &batch->files[i];
+        struct camera* cam = file->camera;
+        struct photo* p = &cam->listing.list.photos[file->photo_index];
+        if (!synced || !(file->targets & 1)) {
+            completed_file_release(file);
+            p->outcome = OUTCOME_FAILED;
+            continue;
+        }
+        if (index) {
+            char tag[MAX_TAG];
+            index_add(index, camera_index_tag(cam, photo_tag(&cam->listing.list, p), tag, sizeof(tag)),
+                      photo_name(&cam->listing.list, p), p->date, file->size, file->content);
+        }
+        p->outcome = OUTCOME_DONE;
+        cam->downloaded++;
+        published++;
+        if (!file->duplicate) {
+            printf("Completed: %s\n", file->filepath[0]);
+        }
+        completed_file_hand_on(session, file);
+    }
+    if (index) {
+        index_sync(index);
+    }
+    
+    if (durable) {
+        printf("Committed %d files in %.2f s\n", published, took);
+    } else if (synced) {
+        fprintf(stderr, "Warning: sync after publishing failed, %d files are published but may not be durable yet\n",
+                published);
+    } else {
+        fprintf(stderr, "Sync failed, %d completed files were not published\n", batch->count);
+    }
+    batch->committed += published;
+    batch->batches++;
+    batch->sync_seconds += took;
+    batch->count = 0;
+}
+
+// Function to add a completed download to the durable batch, committing the batch once it is full.
+// The photo goes into the index only when the batch commits, so a batch that fails leaves no trace there.
+void commit_batch_add(struct transfer_session* session, struct import_index* index, struct transfer* xfer) {
+    struct commit_batch* batch = &session->batch;
+    
+    if (!batch->files) {
+        batch->files = malloc(session->commit_files * sizeof(struct completed_file));
+        if (!batch->files) {
+            fprintf(stderr, "Not enough memory for the commit batch, keeping %s\n", xfer->out[0].partpath);
+            transfer_release_handoff(xfer);
+            record_outcome(index, xfer->camera, xfer->photo_index, 0, 0, 0);
+            return;
+        }
+    }
+    if (batch->count == 0) {
+        batch->opened = now_seconds();
+    }
+    
+    struct completed_file* file = &batch->files[batch->count++];
+    completed_file_init(file, xfer);
+    file_drop_duplicate(session, index, file);
+    if (batch->count >= session->commit_files) {
+        commit_batch(session, index);
+    }
+}
+
+// Function to act on a finished download: hand the file on and record it, or queue another try
+void transfer_complete(struct transfer_session* session, struct transfer* xfer, struct import_index* index,
+                       const struct cli_options* options, CURLcode res) {
+    struct camera* cam = xfer->camera;
+    
+    cam->active--;
+    xfer->draining = 0;
+    if (download_finish(session, xfer, res) == 0) {
+        if (session->commit_files > 0) {
+            commit_batch_add(session, index, xfer);
+            return;
+        }
+        struct completed_file file;
+        completed_file_init(&file, xfer);
+        file_drop_duplicate(session, index, &file);
+        completed_file_hand_on(session, &file);
+        record_outcome(index, cam, file.photo_index, 1, file.size, file.content);
+        cam->downloaded++;
+    } else if (xfer->retryable && xfer->attempt < options->retries &&
+               camera_queue_retry(cam, xfer, options) == 0) {
+        session->retries++;
+    } else {
+        record_outcome(index, cam, xfer->photo_index, 0, 0, 0);
+    }
+}
+
+// Function to complete the transfers whose last blocks are written and to let paused transfers
+// continue once the write pool can take a chunk for each of their targets
+void write_pool_settle(struct transfer_session* session, struct import_index* index,
+                       const struct cli_options* options, double now) {
+    struct write_pool* pool = session->pool;
+    
+    write_pool_collect(pool);
+    for (int s = 0; s < session->slot_count; s++) {
+        struct transfer* xfer = &session->slots[s];
+        if (xfer->draining && write_pool_drained(pool, xfer)) {
+            progress_break(&session->progress);
+            transfer_complete(session, xfer, index, options, xfer->result);
+        }
+        if (!xfer->paused) {
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        int room = pool->free_count >= session->target_count;
+        pthread_mutex_unlock(&pool->lock);
+        if (room) {
+            xfer->paused = 0;
+            pool->paused_seconds += now - xfer->paused_at;
+            curl_easy_pause(xfer->curl, CURLPAUSE_CONT);
+        }
+    }
+}
+
+// Function to ask the writer threads for a wakeup while transfers wait on them.
+// Returns 1 when one can already go on, so the loop must not sleep.
+int write_pool_arm(struct transfer_session* session) {
+    struct write_pool* pool = session->pool;
+    int waiting = 0;
+    int ready = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (int s = 0; s < session->slot_count; s++) {
+        const struct transfer* xfer = &session->slots[s];
+        if (xfer->paused) {
+            waiting = 1;
+            ready = ready || pool->free_count >= session->target_count;
+        }
+        if (xfer->draining) {
+            int pending = 0;
+            for (int t = 0; t < session->target_count; t++) {
+                pending += xfer->out[t].pending;
+            }
+            waiting = 1;
+            ready = ready || pending == 0;
+        }
+    }
+    pool->waiting = waiting;
+    pthread_mutex_unlock(&pool->lock);
+    return ready;
+}
+
+// Set from SIGINT/SIGTERM in watch mode; the running import winds down and the loop ends
+static volatile sig_atomic_t stop_requested = 0;
+
+// Function to download all photos matching the filters from the wanted cameras while their listings
+// are still arriving. Every listing runs in the same multi handle and feeds the queue of its camera,
+// which keeps up to session->jobs downloads of its own in flight, so cameras do not wait on each other.
+// Failed transfers are retried with exponential backoff, resuming from their partial file.
+// Returns the number of photos downloaded or already present.
+int download_photos(struct transfer_session* session, struct camera* cameras, int camera_count,
+                    struct import_index* index, const struct cli_options* options, const char* base_path) {
+    int downloaded = 0;
+    int started = 0;
+    
+    session->started = now_seconds();
+    progress_init(&session->progress, options->progress, session->started);
+    for (int c = 0; c < camera_count; c++) {
+        struct camera* cam = &cameras[c];
+        cam->active = 0;
+        cam->retry_count = 0;
+        cam->downloaded = 0;
+        camera_adapt_init(session, cam, session->started);
+        for (int s = 0; s < session->jobs; s++) {
+            session->slots[c * session->jobs + s].camera = cam;
+        }
+        if (!cam->wanted) {
+            continue;
+        }
+        if (curl_multi_add_handle(session->multi, cam->listing.curl) != CURLM_OK) {
+            fprintf(stderr, "Failed to start listing request for %s\n", cam->url);
+            continue;
+        }
+        cam->listing.running = 1;
+    }
+    
+    for (;;) {
+        double now = now_seconds();
+        
+        if (stop_requested) {
+            progress_break(&session->progress);
+            fprintf(stderr, "Interrupted, stopping the import\n");
+            break;
+        }
+        
+        int idle = 1;
+        for (int c = 0; c < camera_count; c++) {
+            struct camera* cam = &cameras[c];
+            camera_fill_slots(session, cam, &session->slots[c * session->jobs], index, options, base_path, &started, now);
+            
+            // Let the listing continue once the downloads have caught up with it
+            if (cam->listing.paused && cam->listing.list.count - cam->listing.list.next < MAX_QUEUED_PHOTOS / 2) {
+                cam->listing.paused = 0;
+                curl_easy_pause(cam->listing.curl, CURLPAUSE_CONT);
+            }
+            idle = idle && camera_idle(cam);
+        }
+        if (idle) {
+            break;
+        }
+        
+        int running;
+        if (curl_multi_perform(session->multi, &running) != CURLM_OK) {
+            fprintf(stderr, "curl_multi_perform() failed\n");
+            break;
+        }
+        
+        // Collect finished transfers
+        int queued;
+        CURLMsg* msg;
+        while ((msg = curl_multi_info_read(session->multi, &queued)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            progress_break(&session->progress);
+            
+            CURLcode res = msg->data.result;
+            struct camera* lister = NULL;
+            for (int c = 0; c < camera_count && !lister; c++) {
+                if (msg->easy_handle == cameras[c].listing.curl) {
+                    lister = &cameras[c];
+                }
+            }
+            if (lister) {
+                listing_finish(session, lister, res);
+                continue;
+            }
+            
+            struct transfer* xfer = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&xfer);
+            if (!xfer) {
+                continue;
+            }
+            
+            // The last blocks go to the writer threads; the slot stays taken until they are written
+            if (session->pool) {
+                transfer_flush(xfer, 1);
+                xfer->result = res;
+                xfer->draining = 1;
+                continue;
+            }
+            transfer_complete(session, xfer, index, options, res);
+        }
+        if (session->pool) {
+            write_pool_settle(session, index, options, now_seconds());
+        }
+        if (session->batch.count > 0 && now_seconds() - session->batch.opened >= session->commit_seconds) {
+            commit_batch(session, index);
+        }
+        
+        if (session->adaptive) {
+            now = now_seconds();
+            for (int c = 0; c < camera_count; c++) {
+                if (cameras[c].wanted) {
+                    camera_adapt(session, &cameras[c], now);
+                }
+            }
+        }
+        
+        // Go straight back to dispatching when a slot is free and photos are waiting, or when all is done
+        int dispatch = 0;
+        int settled = 1;
+        for (int c = 0; c < camera_count; c++) {
+            const struct camera* cam = &cameras[c];
+            dispatch = dispatch || (cam->active < cam->adapt.limit && photo_list_ready(&cam->listing.list) > 0);
+            settled = settled && !cam->listing.running && cam->active == 0 && cam->retry_count == 0;
+        }
+        if (dispatch || settled) {
+            continue;
+        }
+        
+        now = now_seconds();
+        progress_update(session, cameras, camera_count, now);
+        
+        // Sleep until there is network activity, the next retry is due or progress needs a redraw
+        int timeout_ms = 1000;
+        if (session->progress.mode != PROGRESS_NONE) {
+            int draw_ms = (int)((session->progress.next_draw - now) * 1000.0) + 1;
+            if (draw_ms < timeout_ms) {
+                timeout_ms = draw_ms > 0 ? draw_ms : 0;
+            }
+        }
+        for (int c = 0; c < camera_count; c++) {
+            for (int r = 0; r < cameras[c].retry_count; r++) {
+                int due_ms = (int)((cameras[c].retries[r].due - now) * 1000.0);
+                if (due_ms < timeout_ms) {
+                    timeout_ms = due_ms > 0 ? due_ms : 0;
+                }
+            }
+        }
+        if (session->batch.count > 0) {
+            int commit_ms = (int)((session->batch.opened + session->commit_seconds - now) * 1000.0) + 1;
+            if (commit_ms < timeout_ms) {
+                timeout_ms = commit_ms > 0 ? commit_ms : 0;
+            }
+        }
+        if (session->pool && write_pool_arm(session)) {
+            timeout_ms = 0;
+        }
+        curl_multi_poll(session->multi, NULL, 0, timeout_ms, NULL);
+    }
+    
+    // Abort anything still in flight after a fatal multi error or an interrupt
+    for (int c = 0; c < camera_count; c++) {
+        if (cameras[c].listing.running) {
+            listing_finish(session, &cameras[c], CURLE_ABORTED_BY_CALLBACK);
+        }
+    }
+    for (int s = 0; s < session->slot_count; s++) {
+        struct transfer* xfer = &session->slots[s];
+        if (xfer->draining) {
+            transfer_complete(session, xfer, index, options, xfer->result);
+        } else if (xfer->active) {
+            download_finish(session, xfer, CURLE_ABORTED_BY_CALLBACK);
+            record_outcome(index, xfer->camera, xfer->photo_index, 0, 0, 0);
+        }
+    }
+    
+    // Files already complete are worth keeping however the run ended
+    commit_batch(session, index);
+    if (session->pool) {
+        write_pool_collect(session->pool);
+    }
+    
+    progress_break(&session->progress);
+    for (int c = 0; c < camera_count; c++) {
+        // Photos still waiting out their backoff failed for this run, so the watermark stays below them
+        for (int r = 0; r < cameras[c].retry_count; r++) {
+            record_outcome(index, &cameras[c], cameras[c].retries[r].index, 0, 0, 0);
+        }
+        free(cameras[c].retries);
+        cameras[c].retries = NULL;
+        cameras[c].retry_capacity = 0;
+        cameras[c].retry_count = 0;
+        downloaded += cameras[c].downloaded;
+    }
+    return downloaded;
+}
+
+// Structure for the figures of a run that the metrics file reports
+struct run_metrics {
+    time_t started;             // Wall-clock start of the run
+    double seconds;             // Duration of the run
+    int failed;                 // Photos that failed for good
+    uint64_t bytes_received;    // Bytes of every attempt, failed ones included
+    double* durations;          // Sorted total times of the successful downloads
+    int duration_count;
+    double duration_sum;
+    double connect_sum;         // Time spent connecting over all attempts
+    double ttfb_sum;            // Time to first byte over all attempts
+    long requests;              // Listings plus every download attempt
+    int listed;                 // Listing figures summed over the cameras of the run
+    int below_mark;
+    int filtered;
+    int listing_complete;       // Every listing received in full
+    double listing_seconds;     // Slowest listing request
+    double listing_connect;
+    double listing_ttfb;
+    double parse_seconds;       // Parsing time of all listings
+    uint64_t listing_bytes;
+    int listings_cached;        // Listings answered from the listing cache
+};
+
+// Function to compare doubles for sorting
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Function to pick a nearest-rank percentile from sorted values, 0 when there are none
+double percentile(const double* sorted, int count, int percent) {
+    if (count == 0) {
+        return 0;
+    }
+    int rank = (count * percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Function to gather the run figures from the session and the listings of the cameras that took part
+int metrics_collect(struct run_metrics* m, const struct transfer_session* session,
+                    const struct camera* cameras, int camera_count) {
+    int listings = 0;
+    
+    m->seconds = now_seconds() - session->started;
+    m->failed = 0;
+    m->listed = 0;
+    m->below_mark = 0;
+    m->filtered = 0;
+    m->listing_complete = 1;
+    m->listing_seconds = 0;
+    m->listing_connect = 0;
+    m->listing_ttfb = 0;
+    m->parse_seconds = 0;
+    m->listing_bytes = 0;
+    m->listings_cached = 0;
+    for (int c = 0; c < camera_count; c++) {
+        const struct listing* listing = &cameras[c].listing;
+        if (!cameras[c].wanted) {
+            continue;
+        }
+        listings++;
+        for (int i = 0; i < listing->list.count; i++) {
+            if (listing->list.photos[i].outcome == OUTCOME_FAILED) {
+                m->failed++;
+            }
+        }
+        m->listed += listing->list.count;
+        m->below_mark += listing->list.below_mark;
+        m->filtered += listing->list.filtered;
+        m->listing_complete = m->listing_complete && listing->complete;
+        m->listing_seconds = listing->seconds > m->listing_seconds ? listing->seconds : m->listing_seconds;
+        m->listing_connect = listing->connect > m->listing_connect ? listing->connect : m->listing_connect;
+        m->listing_ttfb = listing->ttfb > m->listing_ttfb ? listing->ttfb : m->listing_ttfb;
+        m->parse_seconds += listing->parse_seconds;
+        m->listing_bytes += listing->bytes;
+        m->listings_cached += listing->cache.reused;
+    }
+    
+    m->bytes_received = 0;
+    m->duration_count = 0;
+    m->duration_sum = 0;
+    m->connect_sum = 0;
+    m->ttfb_sum = 0;
+    m->requests = session->stat_count + listings;
+    m->durations = malloc((session->stat_count + 1) * sizeof(double));
+    if (!m->durations) {
+        return -1;
+    }
+    for (int i = 0; i < session->stat_count; i++) {
+        const struct transfer_stat* st = &session->stats[i];
+        m->bytes_received += st->bytes;
+        m->connect_sum += st->connect;
+        m->ttfb_sum += st->ttfb;
+        if (st->ok) {
+            m->durations[m->duration_count++] = st->seconds;
+            m->duration_sum += st->seconds;
+        }
+    }
+    qsort(m->durations, m->duration_count, sizeof(double), compare_double);
+    return 0;
+}
+
+// Function to write a JSON string literal
+void json_write_string(FILE* fp, const char* str) {
+    fputc('"', fp);
+    for (const unsigned char* c = (const unsigned char*)str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(fp, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(fp, "\\u%04x", *c);
+        } else {
+            fputc(*c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// Function to write the run metrics as JSON, with one entry per download attempt
+void metrics_write_json(FILE* fp, const struct run_metrics* m, const struct transfer_session* session) {
+    long reused = m->requests - session->connections;
+    const struct write_pool* pool = session->pool;
+    
+    fprintf(fp, "{\n  \"started\": %lld,\n  \"duration_seconds\": %.6f,\n", (long long)m->started, m->seconds);
+    fprintf(fp, "  \"listing\": {\"complete\": %s, \"seconds\": %.6f, \"connect_seconds\": %.6f, "
+                "\"ttfb_seconds\": %.6f, \"parse_seconds\": %.6f, \"bytes\": %llu, \"cached\": %d},\n",
+            m->listing_complete ? "true" : "false", m->listing_seconds, m->listing_connect,
+            m->listing_ttfb, m->parse_seconds, (unsigned long long)m->listing_bytes, m->listings_cached);
+    fprintf(fp, "  \"photos\": {\"listed\": %d, \"downloaded\": %d, \"skipped_existing\": %d, "
+                "\"skipped_index\": %d, \"skipped_watermark\": %d, \"filtered\": %d, \"duplicates\": %d, "
+                "\"repaired\": %d, \"failed\": %d},\n",
+            m->listed, session->completed, session->skipped_existing, session->skipped_index,
+            m->below_mark, m->filtered, session->duplicates, session->repaired, m->failed);
+    fprintf(fp, "  \"targets\": [");
+    for (int t = 0; t < session->target_count; t++) {
+        const struct write_target* target = &session->targets[t];
+        fprintf(fp, "%s{\"path\": ", t ? ", " : "");
+        json_write_string(fp, target->path);
+        fprintf(fp, ", \"bytes\": %llu, \"write_seconds\": %.6f, \"slow_writes\": %d, \"failed\": %d}",
+                (unsigned long long)target->bytes, target->write_seconds, target->slow_writes, target->failed);
+    }
+    fprintf(fp, "],\n");
+    fprintf(fp, "  \"post_processing\": {\"processed\": %d, \"failed\": %d},\n",
+            session->post ? session->post->processed : 0, session->post ? session->post->failed : 0);
+    fprintf(fp, "  \"write_pool\": {\"blocks\": %d, \"block_bytes\": %llu, \"peak_in_use\": %d, "
+                "\"pauses\": %d, \"paused_seconds\": %.6f},\n",
+            pool ? pool->count : 0, pool ? (unsigned long long)session->write_buffer : 0ULL,
+            pool ? pool->peak_in_use : 0, pool ? pool->pauses : 0, pool ? pool->paused_seconds : 0);
+    fprintf(fp, "  \"commits\": {\"batches\": %d, \"files\": %d, \"sync_seconds\": %.6f},\n",
+            session->batch.batches, session->batch.committed, session->batch.sync_seconds);
+    fprintf(fp, "  \"retries\": %d,\n  \"stalls\": %d,\n  \"stall_seconds\": %.6f,\n",
+            session->retries, session->stalls, session->stall_seconds);
+    fprintf(fp, "  \"bytes_received\": %llu,\n  \"throughput_bytes_per_second\": %.0f,\n",
+            (unsigned long long)m->bytes_received, m->seconds > 0 ? (double)m->bytes_received / m->seconds : 0);
+    fprintf(fp, "  \"time_to_first_byte_seconds\": %.6f,\n",
+            session->first_byte > 0 ? session->first_byte - session->started : 0);
+    fprintf(fp, "  \"connections\": {\"requests\": %ld, \"opened\": %ld, \"reused\": %ld},\n",
+            m->requests, session->connections, reused > 0 ? reused : 0);
+    fprintf(fp, "  \"file_seconds\": {\"count\": %d, \"sum\": %.6f, \"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f},\n",
+            m->duration_count, m->duration_sum, percentile(m->durations, m->duration_count, 50),
+            percentile(m->durations, m->duration_count, 90), percentile(m->durations, m->duration_count, 99));
+    
+    fprintf(fp, "  \"files\": [");
+    for (int i = 0; i < session->stat_count; i++) {
+        const struct transfer_stat* st = &session->stats[i];
+        const struct photo_list* list = &st->camera->listing.list;
+        const struct photo* p = &list->photos[st->photo_index];
+        char tag[MAX_TAG];
+        fprintf(fp, "%s\n    {\"tag\": ", i ? "," : "");
+        json_write_string(fp, camera_index_tag(st->camera, photo_tag(list, p), tag, sizeof(tag)));
+        fprintf(fp, ", \"name\": ");
+        json_write_string(fp, photo_name(list, p));
+        fprintf(fp, ", \"attempt\": %d, \"ok\": %s, \"bytes\": %llu, \"seconds\": %.6f, "
+                    "\"connect_seconds\": %.6f, \"ttfb_seconds\": %.6f, \"bytes_per_second\": %.0f, \"new_connections\": %ld}",
+                st->attempt + 1, st->ok ? "true" : "false", (unsigned long long)st->bytes, st->seconds,
+                st->connect, st->ttfb, st->speed, st->connects);
+    }
+    fprintf(fp, "%s]\n}\n", session->stat_count ? "\n  " : "");
+}
+
+// Function to write one Prometheus gauge with its help text
+void metrics_write_gauge(FILE* fp, const char* name, const char* help, double value) {
+    fprintf(fp, "# HELP rgr2import_%s %s\n# TYPE rgr2import_%s gauge\nrgr2import_%s %.15g\n", name, help, name, name, value);
+}
+
+// Function to write one sample of a per-target Prometheus series, labelled with the escaped target path
+void metrics_write_target(FILE* fp, const char* name, const struct write_target* target, double value) {
+    fprintf(fp, "rgr2import_%s{path=\"", name);
+    for (const char* c = target->path; *c; c++) {
+        if (*c == '\n') {
+            fputs("\\n", fp);
+            continue;
+        }
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', fp);
+        }
+        fputc(*c, fp);
+    }
+    fprintf(fp, "\"} %.15g\n", value);
+}
+
+// Function to write the run metrics in the Prometheus text format. Per-file figures are summarized,
+// one series per photo would only bloat the collector.
+void metrics_write_prometheus(FILE* fp, const struct run_metrics* m, const struct transfer_session* session) {
+    long reused = m->requests - session->connections;
+    const struct write_pool* pool = session->pool;
+    
+    metrics_write_gauge(fp, "run_timestamp_seconds", "Start of the last run.", (double)m->started);
+    metrics_write_gauge(fp, "run_duration_seconds", "Duration of the last run.", m->seconds);
+    metrics_write_gauge(fp, "listing_complete", "Whether every photo listing was received in full.", m->listing_complete);
+    metrics_write_gauge(fp, "listing_seconds", "Time to fetch the slowest photo listing.", m->listing_seconds);
+    metrics_write_gauge(fp, "listing_connect_seconds", "Slowest connect for a listing.", m->listing_connect);
+    metrics_write_gauge(fp, "listing_ttfb_seconds", "Slowest time to the first byte of a listing.", m->listing_ttfb);
+    metrics_write_gauge(fp, "listing_parse_seconds", "CPU time spent parsing the listings.", m->parse_seconds);
+    metrics_write_gauge(fp, "listing_bytes", "Size of the listings.", (double)m->listing_bytes);
+    metrics_write_gauge(fp, "listings_cached", "Listings unchanged since the last run, taken from the cache.",
+                        m->listings_cached);
+    
+    fprintf(fp, "# HELP rgr2import_photos Photos of the last run by outcome.\n# TYPE rgr2import_photos gauge\n");
+    fprintf(fp, "rgr2import_photos{outcome=\"listed\"} %d\n", m->listed);
+    fprintf(fp, "rgr2import_photos{outcome=\"downloaded\"} %d\n", session->completed);
+    fprintf(fp, "rgr2import_photos{outcome=\"skipped_existing\"} %d\n", session->skipped_existing);
+    fprintf(fp, "rgr2import_photos{outcome=\"skipped_index\"} %d\n", session->skipped_index);
+    fprintf(fp, "rgr2import_photos{outcome=\"skipped_watermark\"} %d\n", m->below_mark);
+    fprintf(fp, "rgr2import_photos{outcome=\"filtered\"} %d\n", m->filtered);
+    fprintf(fp, "rgr2import_photos{outcome=\"duplicate\"} %d\n", session->duplicates);
+    fprintf(fp, "rgr2import_photos{outcome=\"repaired\"} %d\n", session->repaired);
+    fprintf(fp, "rgr2import_photos{outcome=\"failed\"} %d\n", m->failed);
+    
+    fprintf(fp, "# HELP rgr2import_target_bytes Bytes written to each target.\n# TYPE rgr2import_target_bytes gauge\n");
+    for (int t = 0; t < session->target_count; t++) {
+        metrics_write_target(fp, "target_bytes", &session->targets[t], (double)session->targets[t].bytes);
+    }
+    fprintf(fp, "# HELP rgr2import_target_write_seconds Time spent writing to each target.\n"
+                "# TYPE rgr2import_target_write_seconds gauge\n");
+    for (int t = 0; t < session->target_count; t++) {
+        metrics_write_target(fp, "target_write_seconds", &session->targets[t], session->targets[t].write_seconds);
+    }
+    fprintf(fp, "# HELP rgr2import_target_failed Copies given up on each target.\n# TYPE rgr2import_target_failed gauge\n");
+    for (int t = 0; t < session->target_count; t++) {
+        metrics_write_target(fp, "target_failed", &session->targets[t], session->targets[t].failed);
+    }
+    metrics_write_gauge(fp, "post_processed", "Imported files every post-processing handler succeeded on.",
+                        session->post ? session->post->processed : 0);
+    metrics_write_gauge(fp, "post_failed", "Imported files a post-processing handler failed on.",
+                        session->post ? session->post->failed : 0);
+    metrics_write_gauge(fp, "write_pool_blocks", "Receive buffers of the write pool.", pool ? pool->count : 0);
+    metrics_write_gauge(fp, "write_pool_peak_in_use", "Most write pool buffers filled or queued at once.",
+                        pool ? pool->peak_in_use : 0);
+    metrics_write_gauge(fp, "write_pool_pauses", "Transfers paused because every write pool buffer was taken.",
+                        pool ? pool->pauses : 0);
+    metrics_write_gauge(fp, "write_pool_paused_seconds", "Time transfers spent paused for the write pool.",
+                        pool ? pool->paused_seconds : 0);
+    metrics_write_gauge(fp, "commit_batches", "Durable batches committed.", session->batch.batches);
+    metrics_write_gauge(fp, "commit_files", "Files published by durable batches.", session->batch.committed);
+    metrics_write_gauge(fp, "commit_sync_seconds", "Time spent syncing and publishing durable batches.",
+                        session->batch.sync_seconds);
+    metrics_write_gauge(fp, "retries", "Retries scheduled.", session->retries);
+    metrics_write_gauge(fp, "stalls", "Transfers aborted as stalled.", session->stalls);
+    metrics_write_gauge(fp, "stall_seconds", "Time lost to stalled transfers.", session->stall_seconds);
+    metrics_write_gauge(fp, "bytes_received", "Photo bytes received, failed attempts included.", (double)m->bytes_received);
+    metrics_write_gauge(fp, "throughput_bytes_per_second", "Photo bytes received per second of the run.",
+                        m->seconds > 0 ? (double)m->bytes_received / m->seconds : 0);
+    metrics_write_gauge(fp, "time_to_first_byte_seconds", "Time from the start to the first photo byte.",
+                        session->first_byte > 0 ? session->first_byte - session->started : 0);
+    metrics_write_gauge(fp, "requests", "HTTP requests made.", (double)m->requests);
+    metrics_write_gauge(fp, "connections_opened", "Connections opened.", (double)session->connections);
+    metrics_write_gauge(fp, "connections_reused", "Requests served on an already open connection.", reused > 0 ? reused : 0);
+    metrics_write_gauge(fp, "connect_seconds_sum", "Time spent connecting over all download attempts.", m->connect_sum);
+    metrics_write_gauge(fp, "ttfb_seconds_sum", "Time to first byte over all download attempts.", m->ttfb_sum);
+    
+    fprintf(fp, "# HELP rgr2import_file_seconds Time to download one photo.\n# TYPE rgr2import_file_seconds summary\n");
+    fprintf(fp, "rgr2import_file_seconds{quantile=\"0.5\"} %.15g\n", percentile(m->durations, m->duration_count, 50));
+    fprintf(fp, "rgr2import_file_seconds{quantile=\"0.9\"} %.15g\n", percentile(m->durations, m->duration_count, 90));
+    fprintf(fp, "rgr2import_file_seconds{quantile=\"0.99\"} %.15g\n", percentile(m->durations, m->duration_count, 99));
+    fprintf(fp, "rgr2import_file_seconds_sum %.15g\nrgr2import_file_seconds_count %d\n", m->duration_sum, m->duration_count);
+}
+
+// Function to write the metrics file, replacing the previous one atomically so collectors never see half a file
+int metrics_write(const struct cli_options* options, time_t started, const struct transfer_session* session,
+                  const struct camera* cameras, int camera_count) {
+    char tmp_path[MAX_PATH + 8];
+    struct run_metrics m;
+    int format = options->metrics_format;
+    
+    if (format == METRICS_AUTO) {
+        size_t len = strlen(options->metrics_file);
+        format = len > 5 && strcmp(options->metrics_file + len - 5, ".prom") == 0 ? METRICS_PROMETHEUS : METRICS_JSON;
+    }
+    m.started = started;
+    if (metrics_collect(&m, session, cameras, camera_count) != 0) {
+        fprintf(stderr, "Not enough memory for metrics\n");
+        return -1;
+    }
     
-    if (dltotal > 0) {
-        double percentage = (double)dlnow / (double)dltotal * 100.0;
-        printf("\r%s: %.1f%% (%.2f KB / %.2f KB)", 
-               progress->filename, percentage, 
-               (double)dlnow / 1024.0, (double)dltotal / 1024.0);
-        fflush(stdout);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", options->metrics_file);
+    FILE* fp = fopen(tmp_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Warning: cannot write metrics %s: %s\n", tmp_path, strerror(errno));
+        free(m.durations);
+        return -1;
     }
+    if (format == METRICS_PROMETHEUS) {
+        metrics_write_prometheus(fp, &m, session);
+    } else {
+        metrics_write_json(fp, &m, session);
+    }
+    free(m.durations);
     
-    return 0; // Return 0 to continue download
+    if (fclose(fp) != 0 || rename(tmp_path, options->metrics_file) != 0) {
+        fprintf(stderr, "Warning: cannot update metrics %s\n", options->metrics_file);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
 }
 
-// Function to create directory if it doesn't exist
-int create_directory(const char* path) {
-    struct stat st = {0};
-    if (stat(path, &st) == -1) {
-        if (mkdir(path, 0755) == -1) {
-            perror("mkdir");
-            return -1;
-        }
+// Function to check cheaply whether the camera is on the network: a TCP connect, no request.
+// A fresh handle per probe keeps the probe socket from lingering on the camera.
+int camera_probe(const char* base_url) {
+    CURL* curl = curl_easy_init();
+    if (!curl) {
+        return -1;
     }
-    return 0;
+    curl_easy_setopt(curl, CURLOPT_URL, base_url);
+    curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, PROBE_TIMEOUT_MS);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    CURLcode res = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+    return res == CURLE_OK ? 0 : -1;
 }
 
-// Function to check if file exists
-int file_exists(const char* filepath) {
-    return access(filepath, F_OK) == 0;
+// Function to ask the watch loop to stop after the current step
+static void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
 }
 
-// Function to sanitize filename by removing dangerous characters
-void sanitize_filename(char* filename) {
-    if (!filename) return;
-    
-    char* src = filename;
-    char* dst = filename;
+// Function to sleep between probes; a signal cuts the sleep short
+void sleep_seconds(long seconds) {
+    struct timespec delay = { seconds, 0 };
+    nanosleep(&delay, NULL);
+}
+
+// Function to report what writing to each target cost. Writes block the transfer that made them,
+// so a target that spent a large share of the run writing is the one holding the downloads back.
+void target_report(const struct transfer_session* session) {
+    double run_seconds = now_seconds() - session->started;
     
-    while (*src) {
-        // Allow alphanumeric, dots, hyphens, underscores
-        if ((*src >= 'a' && *src <= 'z') ||
-            (*src >= 'A' && *src <= 'Z') ||
-            (*src >= '0' && *src <= '9') ||
-            *src == '.' || *src == '-' || *src == '_') {
-            *dst++ = *src;
+    for (int t = 0; t < session->target_count; t++) {
+        const struct write_target* target = &session->targets[t];
+        printf("Target %s: %.1f MB written, %.1f s spent writing, %d slow writes, %d copies failed\n",
+               target->path, (double)target->bytes / (1024.0 * 1024.0), target->write_seconds,
+               target->slow_writes, target->failed);
+        if (run_seconds > 0 && target->write_seconds > run_seconds / 2) {
+            fprintf(stderr, "Warning: %s fell behind, writing to it took %.1f s of the %.1f s run\n",
+                    target->path, target->write_seconds, run_seconds);
         }
-        // Skip dangerous characters
-        src++;
     }
-    *dst = '\0';
 }
 
-// Function to validate and sanitize path
-int validate_path(const char* path) {
-    if (!path || strlen(path) == 0) return -1;
+// Function to set up the listing request of every camera for a run. The listings are parsed as they
+// arrive; the raw bytes and the entries are kept only when the listing cache is to be updated.
+void listings_prepare(struct transfer_session* session, struct camera* cameras, int camera_count,
+                      const struct cli_options* options, const char* base_path, struct priority_list* priority,
+                      const struct name_set* names, int update_cache) {
+    char listing_url[MAX_URL + 16];
+    uint32_t today = current_date();
     
-    // Check for path traversal attempts
-    if (strstr(path, "..") != NULL) return -1;
-    if (strstr(path, "//") != NULL) return -1;
-    
-    // Check for null bytes
-    if (strlen(path) != strcspn(path, "\0")) return -1;
-    
-    // Check maximum path length
-    if (strlen(path) >= MAX_PATH) return -1;
-    
-    return 0;
+    for (int c = 0; c < camera_count; c++) {
+        struct camera* cam = &cameras[c];
+        struct listing* listing = &cam->listing;
+        memset(listing, 0, sizeof(*listing));
+        listing->list.mark = cam->have_mark ? &cam->mark : NULL;
+        listing->list.policy = options->order;
+        listing->list.priority = options->priority_file[0] != '\0' ? priority : NULL;
+        listing->list.ordered = options->order != ORDER_LISTING || listing->list.priority != NULL;
+        listing->list.format = options->format;
+        listing->list.names = names->count > 0 ? names : NULL;
+        listing->list.today = today;
+        listing->list.records = update_cache ? &listing->cache.records : NULL;
+        listing_cache_open(&listing->cache, base_path, cam->label);
+        objs_parser_init(&listing->parser, photo_list_dir, photo_list_file, &listing->list);
+        listing->curl = session->listings[c];
+#ifdef WITH_TRACE
+        listing->track = TRACE_LISTING_TRACK + c;
+#endif
+        snprintf(listing_url, sizeof(listing_url), "%s/_gr/objs", cam->url);
+        listing_prepare(listing, listing_url);
+    }
 }
 
-// Function to convert timestamp to date folder format (YYYY-MM-DD)
-void timestamp_to_date_folder(const char* timestamp, char* date_folder) {
-    // Parse timestamp and convert to YYYY-MM-DD format
-    struct tm tm_info = {0};
-    time_t t;
-    
-    // Try to parse the timestamp (assuming format like "20241222T120000" or similar) 2025-06-07T09:32:40
-    if (sscanf(timestamp, "%4d-%2d-%2dT%2d:%2d:%2d", 
-               &tm_info.tm_year, &tm_info.tm_mon, &tm_info.tm_mday,
-               &tm_info.tm_hour, &tm_info.tm_min, &tm_info.tm_sec) >= 3) {
-        tm_info.tm_year -= 1900;  // tm_year is years since 1900
-        tm_info.tm_mon -= 1;      // tm_mon is 0-11
-        
-        snprintf(date_folder, MAX_DATE, "%04d-%02d-%02d", 
-                tm_info.tm_year + 1900, tm_info.tm_mon + 1, tm_info.tm_mday);
-    } else {
-        // Fallback to current date if parsing fails
-        t = time(NULL);
-        struct tm* current_tm = localtime(&t);
-        strftime(date_folder, MAX_DATE, "%Y-%m-%d", current_tm);
+// Function to release the listings of a run
+void listings_free(struct camera* cameras, int camera_count) {
+    for (int c = 0; c < camera_count; c++) {
+        struct camera* cam = &cameras[c];
+        objs_parser_free(&cam->listing.parser);
+        photo_list_free(&cam->listing.list);
+        listing_cache_free(&cam->listing.cache);
     }
 }
 
-// Function to download a single photo
-int download_photo(const char* base_url, const char* name, const char* tag, const char* date_folder, const char* base_path) {
-    CURL* curl;
-    CURLcode res;
-    FILE* fp;
-    char url[MAX_URL];
-    char filepath[MAX_FILEPATH];
-    char full_dir_path[MAX_PATH];
-    struct progress_data progress_data;
+// Function to read the throughput of earlier imports into a target, as decayed sums of bytes and seconds.
+// Returns -1 when there is no history yet.
+int throughput_load(const char* base_path, double* bytes, double* seconds) {
+    char path[MAX_FILEPATH];
     
-    // Validate input parameters
-    if (!base_url || !name || !tag || !date_folder || !base_path) {
-        fprintf(stderr, "Invalid parameters to download_photo\n");
+    snprintf(path, sizeof(path), "%s/%s", base_path, THROUGHPUT_FILENAME);
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
         return -1;
     }
+    int rc = fscanf(fp, "%lf %lf", bytes, seconds) == 2 && *bytes > 0 && *seconds > 0 ? 0 : -1;
+    fclose(fp);
+    return rc;
+}
+
+// Function to fold the transfer of this run into the throughput history; each earlier run counts half as
+// much as the one after it, so the estimate follows a camera that got faster or slower
+void throughput_save(const char* base_path, uint64_t bytes, double seconds) {
+    char path[MAX_FILEPATH];
+    char tmp_path[MAX_FILEPATH + 8];
+    double old_bytes = 0;
+    double old_seconds = 0;
     
-    // Validate base_path
-    if (validate_path(base_path) != 0) {
-        fprintf(stderr, "Invalid base path: %s\n", base_path);
-        return -1;
+    if (throughput_load(base_path, &old_bytes, &old_seconds) != 0) {
+        old_bytes = 0;
+        old_seconds = 0;
+    }
+    snprintf(path, sizeof(path), "%s/%s", base_path, THROUGHPUT_FILENAME);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* fp = fopen(tmp_path, "w");
+    if (!fp) {
+        return;
     }
+    fprintf(fp, "%.0f %.6f\n", old_bytes / 2 + (double)bytes, old_seconds / 2 + seconds);
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+// Function to run one import against the wanted cameras: list, download, advance the watermarks and report.
+// A camera stays wanted when its listing broke off or a photo failed, so a later pass picks it up again.
+// Returns 0 when nothing is left for a later pass.
+int import_once(struct transfer_session* session, struct camera* cameras, int camera_count,
+                struct import_index* index, const struct cli_options* options, const char* base_path,
+                struct priority_list* priority, const struct name_set* names, int track_mark, int* downloaded) {
+    time_t run_started = time(NULL);
+    int finished[MAX_CAMERAS];
+    int unfinished = 0;
     
-    // Create full directory path
-    snprintf(full_dir_path, sizeof(full_dir_path), "%s/%s", base_path, date_folder);
+    session_reset_run(session);
+    listings_prepare(session, cameras, camera_count, options, base_path, priority, names, 1);
     
-    // Validate the full directory path
-    if (validate_path(full_dir_path) != 0) {
-        fprintf(stderr, "Invalid directory path: %s\n", full_dir_path);
-        return -1;
+    // Fetch the listings and download photos as they appear in them
+    *downloaded = download_photos(session, cameras, camera_count, index, options, base_path);
+    double transfer_seconds = now_seconds() - session->started;
+    if (session->post) {
+        post_pool_drain(session->post);
     }
     
-    // Create directory if it doesn't exist
-    if (create_directory(full_dir_path) != 0) {
-        return -1;
+    printf("\n");
+    for (int c = 0; c < camera_count; c++) {
+        struct camera* cam = &cameras[c];
+        finished[c] = 1;
+        if (!cam->wanted) {
+            continue;
+        }
+        
+        // Only a complete listing shows which photos the watermark may pass
+        if (track_mark && cam->listing.complete &&
+            watermark_advance(&cam->listing.list, &cam->mark, cam->have_mark)) {
+            cam->have_mark = 1;
+            watermark_save(base_path, cam->label, options->format, &cam->mark);
+            printf("Import watermark of %s advanced to %s/%s\n", cam->url, cam->mark.tag, cam->mark.name);
+        }
+        
+        int failed = 0;
+        for (int i = 0; i < cam->listing.list.count; i++) {
+            if (cam->listing.list.photos[i].outcome == OUTCOME_FAILED) {
+                failed++;
+            }
+        }
+        if (camera_count > 1) {
+            printf("Camera %s (%s): %d photos, %d failed%s\n", cam->label, cam->url, cam->downloaded, failed,
+                   cam->listing.complete ? "" : ", listing incomplete");
+        }
+        if (session->adaptive) {
+            printf("Adaptive concurrency for %s settled at %d of %d transfers (%d increases, %d decreases)\n",
+                   cam->url, cam->adapt.limit, session->jobs, cam->adapt.increases, cam->adapt.decreases);
+        }
+        finished[c] = cam->listing.complete && failed == 0 && !stop_requested;
+        unfinished += !finished[c];
     }
     
-    // Create full file path
-    snprintf(filepath, sizeof(filepath), "%s/%s", full_dir_path, name);
+    printf("Download complete. Downloaded %d photos to %s\n", *downloaded, base_path);
+    printf("Connections opened: %ld\n", session->connections);
+    printf("Retries: %d, stalled transfers: %d (%.1f s lost to stalls)\n",
+           session->retries, session->stalls, session->stall_seconds);
+    if (session->verify) {
+        printf("Duplicates dropped: %d, truncated files resumed: %d\n", session->duplicates, session->repaired);
+    }
+    if (session->post) {
+        printf("Post-processed: %d files, %d failed\n", session->post->processed, session->post->failed);
+    }
+    if (session->commit_files > 0) {
+        printf("Durable commits: %d files in %d batches, %.1f s syncing\n",
+               session->batch.committed, session->batch.batches, session->batch.sync_seconds);
+    }
+    if (session->pool) {
+        printf("Write pool: peak %d of %d blocks in use, transfers paused %d times (%.1f s)\n",
+               session->pool->peak_in_use, session->pool->count, session->pool->pauses, session->pool->paused_seconds);
+    }
+    if (session->target_count > 1) {
+        target_report(session);
+    }
+    if (session->preview && options->preview_cache_mb > 0) {
+        preview_trim(base_path, options->preview_cache_mb);
+    }
+    if (session->first_byte > 0) {
+        printf("Time to first photo byte: %.2f s\n", session->first_byte - session->started);
+    }
+    if (options->metrics_file[0] != '\0') {
+        metrics_write(options, run_started, session, cameras, camera_count);
+    }
     
-    // Check if file already exists
-    if (file_exists(filepath)) {
-        printf("File already exists, skipping: %s\n", filepath);
-        return 0;
+    // Previews are a fraction of the photo sizes, they would only skew what --plan estimates
+    if (!session->preview && session->bytes > 0) {
+        throughput_save(base_path, session->bytes, transfer_seconds);
     }
     
-    // Create download URL
-    snprintf(url, sizeof(url), "%s/v1/photos/%s/%s", base_url, tag, name);
+    for (int c = 0; c < camera_count; c++) {
+        cameras[c].wanted = cameras[c].wanted && !finished[c];
+    }
+    listings_free(cameras, camera_count);
+    return unfinished > 0 ? -1 : 0;
+}
+
+// Structure for one photo an import would transfer
+struct plan_entry {
+    struct camera* camera;
+    int photo_index;
+    uint64_t size;          // From the listing, the index or a HEAD request, 0 when unknown
+    uint64_t resume_from;   // Bytes already on disk in a partial file or a truncated copy
+};
+
+// Structure for the outcome of --plan
+struct import_plan {
+    struct plan_entry* entries;
+    int count;
+    int capacity;
+    int listed;
+    int skipped_index;
+    int skipped_existing;
+    int conflicts;          // Files on disk larger than the camera's copy, an import leaves them alone
+    int unknown;            // Sizes neither listed nor answered by a HEAD request
+    int complete;           // Every listing arrived in full
+    uint64_t bytes;         // Still to transfer
+    uint64_t resume_bytes;  // Already on disk, an import resumes after them
+    double rate;            // Bytes per second of earlier imports, 0 without history
+};
+
+// Function to run the listings of the wanted cameras to the end without starting any download
+void plan_listings(struct transfer_session* session, struct camera* cameras, int camera_count) {
+    int pending = 0;
     
-    // Setup progress data
-    strncpy(progress_data.filename, name, sizeof(progress_data.filename) - 1);
-    progress_data.filename[sizeof(progress_data.filename) - 1] = '\0';
+    for (int c = 0; c < camera_count; c++) {
+        if (cameras[c].wanted && curl_multi_add_handle(session->multi, cameras[c].listing.curl) == CURLM_OK) {
+            cameras[c].listing.running = 1;
+            pending++;
+        }
+    }
     
-    // Open file for writing
-    fp = fopen(filepath, "wb");
-    if (!fp) {
-        perror("fopen");
-        return -1;
+    while (pending > 0) {
+        int running;
+        if (curl_multi_perform(session->multi, &running) != CURLM_OK) {
+            fprintf(stderr, "curl_multi_perform() failed\n");
+            break;
+        }
+        
+        int queued;
+        CURLMsg* msg;
+        while ((msg = curl_multi_info_read(session->multi, &queued)) != NULL) {
+            for (int c = 0; msg->msg == CURLMSG_DONE && c < camera_count; c++) {
+                if (msg->easy_handle == cameras[c].listing.curl) {
+                    listing_finish(session, &cameras[c], msg->data.result);
+                    pending--;
+                }
+            }
+        }
+        if (pending > 0) {
+            curl_multi_poll(session->multi, NULL, 0, 1000, NULL);
+        }
+    }
+    
+    for (int c = 0; c < camera_count; c++) {
+        if (cameras[c].listing.running) {
+            listing_finish(session, &cameras[c], CURLE_ABORTED_BY_CALLBACK);
+        }
     }
+}
+
+// Function to decide for every listed photo of a camera what an import would do with it. The checks are
+// those of the downloads, in their order, but they only read: the index, then the file and its partial copy.
+int plan_camera(const struct transfer_session* session, struct import_plan* plan, struct camera* cam,
+                const struct import_index* index, const char* base_path) {
+    const struct photo_list* list = &cam->listing.list;
+    char path[MAX_FILEPATH];
+    char part[MAX_FILEPATH + sizeof(PART_SUFFIX)];
+    char index_tag[MAX_TAG];
+    struct stat st;
     
-    curl = curl_easy_init();
-    if (curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    plan->listed += list->count;
+    for (int n = 0; n < list->count; n++) {
+        int i = list->order ? list->order[n] : n;
+        const struct photo* p = &list->photos[i];
+        const char* name = photo_name(list, p);
+        const char* tag = photo_tag(list, p);
         
-        // Enable progress callback
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
-        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &progress_data);
+        const struct index_entry* known =
+            index ? index_find(index, camera_index_tag(cam, tag, index_tag, sizeof(index_tag)), name, p->date, p->size) : NULL;
+        if (known && (!session->verify || imported_file_intact(session, index, base_path, cam, p->date, name, known))) {
+            plan->skipped_index++;
+            continue;
+        }
         
-        res = curl_easy_perform(curl);
+        uint64_t size = p->size ? p->size : known ? known->size : 0;
+        uint64_t resume_from = 0;
+        format_photo_path(session, base_path, p->date, cam->label, name, "", path, sizeof(path));
+        snprintf(part, sizeof(part), "%s" PART_SUFFIX, path);
+        if (stat(path, &st) == 0) {
+            if (!session->verify || size == 0 || (uint64_t)st.st_size == size) {
+                plan->skipped_existing++;
+                continue;
+            }
+            if ((uint64_t)st.st_size > size) {
+                plan->conflicts++;
+                continue;
+            }
+            resume_from = (uint64_t)st.st_size;
+        } else if (stat(part, &st) == 0 && st.st_size > 0) {
+            resume_from = (uint64_t)st.st_size;
+        }
         
-        if (res != CURLE_OK) {
-            printf("\n"); // New line after progress
-            fprintf(stderr, "Download failed for %s: %s\n", name, curl_easy_strerror(res));
-            fclose(fp);
-            unlink(filepath); // Remove incomplete file
-            curl_easy_cleanup(curl);
-            return -1;
+        // A partial file as long as the photo or longer is refused by the camera and fetched again in full
+        if (size && resume_from >= size) {
+            resume_from = 0;
         }
         
-        curl_easy_cleanup(curl);
+        if (plan->count >= plan->capacity) {
+            int capacity = plan->capacity ? plan->capacity * 2 : 256;
+            struct plan_entry* grown = realloc(plan->entries, capacity * sizeof(struct plan_entry));
+            if (!grown) {
+                fprintf(stderr, "Not enough memory for the import plan\n");
+                return -1;
+            }
+            plan->entries = grown;
+            plan->capacity = capacity;
+        }
+        struct plan_entry* e = &plan->entries[plan->count++];
+        e->camera = cam;
+        e->photo_index = i;
+        e->size = size;
+        e->resume_from = resume_from;
     }
-    
-    fclose(fp);
-    printf("\nCompleted: %s\n", filepath);
     return 0;
 }
 
-// Function to parse JSON response using cJSON
-int parse_photos_json(const char* json_data, struct photo** photos, int* photo_count) {
-    cJSON* json = cJSON_Parse(json_data);
-    if (!json) {
-        fprintf(stderr, "Error parsing JSON: %s\n", cJSON_GetErrorPtr());
-        return -1;
+// Function to ask the camera for the sizes the listing left out, one HEAD request per photo on every slot
+void plan_head_sizes(struct transfer_session* session, struct import_plan* plan) {
+    char url[MAX_URL];
+    int next = 0;
+    int active = 0;
+    
+    for (;;) {
+        for (int s = 0; s < session->slot_count; s++) {
+            struct transfer* xfer = &session->slots[s];
+            while (next < plan->count && plan->entries[next].size != 0) {
+                next++;
+            }
+            if (xfer->active || next >= plan->count) {
+                continue;
+            }
+            
+            struct plan_entry* e = &plan->entries[next++];
+            const struct photo_list* list = &e->camera->listing.list;
+            const struct photo* p = &list->photos[e->photo_index];
+            snprintf(url, sizeof(url), "%s/v1/photos/%s/%s", e->camera->url, photo_tag(list, p), photo_name(list, p));
+            session_prepare(xfer->curl, url);
+            curl_easy_setopt(xfer->curl, CURLOPT_NOBODY, 1L);
+            curl_easy_setopt(xfer->curl, CURLOPT_FAILONERROR, 1L);
+            curl_easy_setopt(xfer->curl, CURLOPT_CONNECTTIMEOUT, 10L);
+            curl_easy_setopt(xfer->curl, CURLOPT_TIMEOUT, 30L);
+            curl_easy_setopt(xfer->curl, CURLOPT_PRIVATE, e);
+            if (curl_multi_add_handle(session->multi, xfer->curl) == CURLM_OK) {
+                xfer->active = 1;
+                active++;
+            }
+        }
+        if (active == 0) {
+            break;
+        }
+        
+        int running;
+        if (curl_multi_perform(session->multi, &running) != CURLM_OK) {
+            fprintf(stderr, "curl_multi_perform() failed\n");
+            break;
+        }
+        int queued;
+        CURLMsg* msg;
+        while ((msg = curl_multi_info_read(session->multi, &queued)) != NULL) {
+            for (int s = 0; msg->msg == CURLMSG_DONE && s < session->slot_count; s++) {
+                struct transfer* xfer = &session->slots[s];
+                if (!xfer->active || msg->easy_handle != xfer->curl) {
+                    continue;
+                }
+                struct plan_entry* e = NULL;
+                curl_off_t length = -1;
+                curl_easy_getinfo(xfer->curl, CURLINFO_PRIVATE, (char**)&e);
+                curl_easy_getinfo(xfer->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+                if (msg->data.result == CURLE_OK && length > 0) {
+                    e->size = (uint64_t)length;
+                }
+                curl_multi_remove_handle(session->multi, xfer->curl);
+                session_count_connections(session, xfer->curl);
+                xfer->active = 0;
+                active--;
+            }
+        }
+        if (active > 0) {
+            curl_multi_poll(session->multi, NULL, 0, 1000, NULL);
+        }
     }
+}
+
+// Function to print the import plan
+void plan_print(const struct import_plan* plan) {
+    double mb = 1024.0 * 1024.0;
+    char eta[32];
     
-    cJSON* dirs = cJSON_GetObjectItemCaseSensitive(json, "dirs");
-    if (!cJSON_IsArray(dirs)) {
-        fprintf(stderr, "No 'dirs' array found in JSON\n");
-        cJSON_Delete(json);
-        return -1;
+    printf("\nImport plan:\n");
+    printf("  Listed:           %d photos\n", plan->listed);
+    printf("  Already imported: %d in the index, %d on disk\n", plan->skipped_index, plan->skipped_existing);
+    if (plan->conflicts) {
+        printf("  Left alone:       %d files on disk larger than the camera's copy\n", plan->conflicts);
+    }
+    printf("  To transfer:      %d files, %.1f MB\n", plan->count, (double)plan->bytes / mb);
+    if (plan->resume_bytes) {
+        printf("  Resuming after:   %.1f MB already on disk\n", (double)plan->resume_bytes / mb);
+    }
+    if (plan->unknown) {
+        printf("  Unknown size:     %d files, not counted above\n", plan->unknown);
     }
+    if (plan->rate > 0) {
+        format_duration((double)plan->bytes / plan->rate, eta, sizeof(eta));
+        printf("  Estimated time:   %s at %.1f MB/s, the rate of earlier imports\n", eta, plan->rate / mb);
+    } else {
+        printf("  Estimated time:   unknown until a first import into this target\n");
+    }
+    if (!plan->complete) {
+        printf("  A photo list was incomplete, the plan only covers what arrived\n");
+    }
+}
+
+// Function to write the import plan as JSON, replacing the file atomically
+int plan_write_json(const struct import_plan* plan, const char* path) {
+    char tmp_path[MAX_PATH + 8];
+    char date_folder[MAX_DATE];
     
-    int capacity = 100;
-    *photos = malloc(capacity * sizeof(struct photo));
-    if (!*photos) {
-        cJSON_Delete(json);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* fp = fopen(tmp_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Warning: cannot write plan %s: %s\n", tmp_path, strerror(errno));
         return -1;
     }
     
-    int count = 0;
-    cJSON* dir;
-    cJSON_ArrayForEach(dir, dirs) {
-        cJSON* tag = cJSON_GetObjectItemCaseSensitive(dir, "name");
-        if (!cJSON_IsString(tag) || !tag->valuestring) {
-            continue; // Skip if name is not a string
+    fprintf(fp, "{\n  \"complete\": %s,\n  \"listed\": %d,\n  \"skipped_index\": %d,\n  \"skipped_existing\": %d,\n",
+            plan->complete ? "true" : "false", plan->listed, plan->skipped_index, plan->skipped_existing);
+    fprintf(fp, "  \"conflicts\": %d,\n  \"files\": %d,\n  \"bytes\": %llu,\n  \"resume_bytes\": %llu,\n"
+                "  \"unknown_sizes\": %d,\n",
+            plan->conflicts, plan->count, (unsigned long long)plan->bytes,
+            (unsigned long long)plan->resume_bytes, plan->unknown);
+    if (plan->rate > 0) {
+        fprintf(fp, "  \"rate_bytes_per_second\": %.0f,\n  \"estimated_seconds\": %.3f,\n",
+                plan->rate, (double)plan->bytes / plan->rate);
+    } else {
+        fprintf(fp, "  \"rate_bytes_per_second\": null,\n  \"estimated_seconds\": null,\n");
+    }
+    
+    fprintf(fp, "  \"entries\": [");
+    for (int i = 0; i < plan->count; i++) {
+        const struct plan_entry* e = &plan->entries[i];
+        const struct photo_list* list = &e->camera->listing.list;
+        const struct photo* p = &list->photos[e->photo_index];
+        format_date_folder(p->date, date_folder);
+        fprintf(fp, "%s\n    {\"camera\": ", i ? "," : "");
+        json_write_string(fp, e->camera->label[0] ? e->camera->label : e->camera->url);
+        fprintf(fp, ", \"tag\": ");
+        json_write_string(fp, photo_tag(list, p));
+        fprintf(fp, ", \"name\": ");
+        json_write_string(fp, photo_name(list, p));
+        fprintf(fp, ", \"date\": \"%s\", ", date_folder);
+        if (e->size) {
+            fprintf(fp, "\"size\": %llu, ", (unsigned long long)e->size);
+        } else {
+            fprintf(fp, "\"size\": null, ");
         }
+        fprintf(fp, "\"resume_from\": %llu}", (unsigned long long)e->resume_from);
+    }
+    fprintf(fp, "%s]\n}\n", plan->count ? "\n  " : "");
+    
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Warning: cannot update plan %s\n", path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
 
-        cJSON* files = cJSON_GetObjectItemCaseSensitive(dir, "files");
-        if (!cJSON_IsArray(files)) {
-            continue;
+// Function to work out what an import would do without doing it. The listings are fetched and filtered
+// and every photo is checked as a download would check it; sizes the listing lacks come from HEAD requests
+// and the time from the throughput of earlier imports. Nothing is written below the target: no folders,
+// no partial files, and neither the index, the watermarks nor the listing cache change.
+int plan_import(struct transfer_session* session, struct camera* cameras, int camera_count,
+                const struct import_index* index, const struct cli_options* options, const char* base_path,
+                struct priority_list* priority, const struct name_set* names) {
+    struct import_plan plan;
+    double bytes;
+    double seconds;
+    int rc = 0;
+    
+    memset(&plan, 0, sizeof(plan));
+    session_reset_run(session);
+    listings_prepare(session, cameras, camera_count, options, base_path, priority, names, 0);
+    
+    // Nothing consumes the queue while planning, so the listings must never be held back
+    for (int c = 0; c < camera_count; c++) {
+        cameras[c].listing.list.ordered = 1;
+    }
+    plan_listings(session, cameras, camera_count);
+    
+    plan.complete = 1;
+    for (int c = 0; c < camera_count && rc == 0; c++) {
+        if (cameras[c].wanted) {
+            plan.complete = plan.complete && cameras[c].listing.complete;
+            rc = plan_camera(session, &plan, &cameras[c], index, base_path);
         }
-        
-        cJSON* file;
-        cJSON_ArrayForEach(file, files) {
-            if (count >= capacity) {
-                capacity *= 2;
-                *photos = realloc(*photos, capacity * sizeof(struct photo));
-                if (!*photos) {
-                    cJSON_Delete(json);
-                    return -1;
-                }
+    }
+    
+    if (rc == 0) {
+        plan_head_sizes(session, &plan);
+        for (int i = 0; i < plan.count; i++) {
+            const struct plan_entry* e = &plan.entries[i];
+            if (e->size) {
+                plan.bytes += e->size - e->resume_from;
+                plan.resume_bytes += e->resume_from;
+            } else {
+                plan.unknown++;
             }
-            
-            // Extract name
-            cJSON* name = cJSON_GetObjectItemCaseSensitive(file, "n");
-            if (cJSON_IsString(name) && name->valuestring) {
-                strncpy((*photos)[count].name, name->valuestring, sizeof((*photos)[count].name) - 1);
-                (*photos)[count].name[sizeof((*photos)[count].name) - 1] = '\0';
-                sanitize_filename((*photos)[count].name);
-                
-                strncpy((*photos)[count].tag, tag->valuestring, sizeof((*photos)[count].tag) - 1);
-                (*photos)[count].tag[sizeof((*photos)[count].tag) - 1] = '\0';
-                sanitize_filename((*photos)[count].tag);
-                
-                // Skip if filename becomes empty after sanitization
-                if (strlen((*photos)[count].name) == 0) {
-                    continue;
-                }
+        }
+        if (throughput_load(base_path, &bytes, &seconds) == 0) {
+            plan.rate = bytes / seconds;
+        }
+        
+        plan_print(&plan);
+        if (options->plan_json[0] != '\0') {
+            rc = plan_write_json(&plan, options->plan_json);
+        }
+    }
+    
+    free(plan.entries);
+    listings_free(cameras, camera_count);
+    return rc;
+}
+
+// Function to wait for the cameras and import each time one joins the network.
+// The session, its warm handles and the open index carry over from one appearance to the next.
+// A camera that appears while an import runs is picked up by the next probe.
+void watch_cameras(struct transfer_session* session, struct camera* cameras, int camera_count,
+                   struct import_index* index, const struct cli_options* options, const char* base_path,
+                   struct priority_list* priority, const struct name_set* names, int track_mark) {
+    struct sigaction action;
+    
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    
+    if (camera_count == 1) {
+        printf("Watching for the camera at %s every %ld s, Ctrl-C to stop\n", cameras[0].url, options->watch_interval);
+    } else {
+        printf("Watching for %d cameras every %ld s, Ctrl-C to stop\n", camera_count, options->watch_interval);
+    }
+    for (int c = 0; c < camera_count; c++) {
+        cameras[c].present = 0;
+        cameras[c].wanted = 0;
+    }
+    
+    while (!stop_requested) {
+        int due = 0;
+        for (int c = 0; c < camera_count; c++) {
+            struct camera* cam = &cameras[c];
+            int reachable = camera_probe(cam->url) == 0;
+            if (reachable != cam->present) {
+                printf(reachable ? "Camera appeared at %s\n" : "Camera at %s went away\n", cam->url);
+                cam->present = reachable;
+                cam->wanted = reachable;
             }
             
-            // Extract date from "d" field
-            cJSON* d = cJSON_GetObjectItemCaseSensitive(file, "d");
-            if (cJSON_IsString(d) && d->valuestring) {
-                timestamp_to_date_folder(d->valuestring, (*photos)[count].date);
-            } else {
-                // Fallback to current date
-                time_t t = time(NULL);
-                struct tm* tm_info = localtime(&t);
-                strftime((*photos)[count].date, sizeof((*photos)[count].date), "%Y-%m-%d", tm_info);
+            // An import cut short by a failure or by the camera leaving is retried on the next probe
+            cam->wanted = cam->wanted && cam->present;
+            due = due || cam->wanted;
+        }
+        
+        if (due) {
+            int downloaded;
+            if (import_once(session, cameras, camera_count, index, options, base_path,
+                            priority, names, track_mark, &downloaded) == 0) {
+                printf("Waiting for new photos, next import when a camera reappears\n");
             }
-            
-            count++;
+        }
+        
+        if (!stop_requested) {
+            sleep_seconds(options->watch_interval);
         }
     }
-    
-    *photo_count = count;
-    cJSON_Delete(json);
-    return 0;
+    printf("Stopped watching\n");
 }
 
 int main(int argc, char* argv[]) {
-    CURL* curl;
-    CURLcode res;
-    struct http_response response;
-    struct photo* photos = NULL;
-    int photo_count = 0;
+    struct transfer_session session;
+    struct post_pool post;
+    struct write_pool pool;
+    struct import_index index;
+    struct import_index* index_ptr = NULL;
+    struct camera cameras[MAX_CAMERAS];
+    int track_mark = 0;
+    struct priority_list priority = { NULL, 0 };
+    struct name_set names = { NULL, 0, 0 };
     char base_path[MAX_PATH];
+    char preview_dir[MAX_PATH + sizeof(PREVIEW_DIRNAME)];
+    const char* import_path = base_path;
     const char* home = getenv("HOME");
     struct cli_options options;
     
@@ -454,10 +6843,59 @@ int main(int argc, char* argv[]) {
         return 0;
     }
     
+    if (options.priority_file[0] != '\0') {
+        if (priority_load(&priority, options.priority_file) != 0) {
+            return 1;
+        }
+        printf("Priority list: %d photos\n", priority.count);
+    }
+    
+    // --files-from and -F select photos alike; the listing is checked against them as it is parsed
+    if (options.files_from[0] != '\0') {
+        if (name_set_load(&names, options.files_from) != 0) {
+            return 1;
+        }
+        printf("File list: %d photos\n", names.count);
+    }
+    if (options.filename[0] != '\0' && name_set_add(&names, options.filename) != 0) {
+        fprintf(stderr, "Not enough memory for the file list\n");
+        return 1;
+    }
+    
+#ifdef WITH_BENCH
+    // A benchmark imports from a local mock camera into a scratch directory
+    char bench_dir[] = "/tmp/rgr2import-bench.XXXXXX";
+    int bench = options.bench_listing[0] != '\0';
+    if (bench) {
+        int port;
+        if (bench_server_start(options.bench_listing, &port) != 0) {
+            return 1;
+        }
+        snprintf(options.cameras[0].url, sizeof(options.cameras[0].url), "http://127.0.0.1:%d", port);
+        options.cameras[0].label[0] = '\0';
+        options.camera_count = 1;
+        if (options.target_count > 0) {
+            bench_dir[0] = '\0';
+        } else if (mkdtemp(bench_dir)) {
+            snprintf(options.target_paths[0], sizeof(options.target_paths[0]), "%s", bench_dir);
+            options.target_count = 1;
+        } else {
+            perror("mkdtemp");
+            bench_server_stop();
+            return 1;
+        }
+    }
+#endif
+#ifdef WITH_TRACE
+    if (options.trace_file[0] != '\0' && trace_start(options.trace_file) != 0) {
+        return 1;
+    }
+#endif
+    
     // Determine target path
-    if (options.target_path[0] != '\0') {
+    if (options.target_count > 0) {
         // Use user-specified path (already validated in parse_arguments)
-        snprintf(base_path, sizeof(base_path), "%s", options.target_path);
+        snprintf(base_path, sizeof(base_path), "%s", options.target_paths[0]);
     } else {
         // Use default path
         if (!home) {
@@ -473,84 +6911,174 @@ int main(int argc, char* argv[]) {
         }
     }
     
+    // Photo paths are built by appending to the base, so drop a trailing slash
+    size_t base_len = strlen(base_path);
+    while (base_len > 1 && base_path[base_len - 1] == '/') {
+        base_path[--base_len] = '\0';
+    }
+    
     printf("Target directory: %s\n", base_path);
     
-    // Create base directory
-    if (create_directory(base_path) != 0) {
+    // Create base directory; a plan creates nothing and finds a missing one empty
+    if (!options.plan && create_directory(base_path) != 0) {
         return 1;
     }
     
-    // Initialize response structure
-    response.data = malloc(1);
-    response.size = 0;
+    // Additional targets receive a copy of every download, the index and watermarks stay with the primary one
+    for (int t = 1; t < options.target_count; t++) {
+        char* target = options.target_paths[t];
+        size_t len = strlen(target);
+        while (len > 1 && target[len - 1] == '/') {
+            target[--len] = '\0';
+        }
+        for (int u = 0; u < t; u++) {
+            if (strcmp(target, u == 0 ? base_path : options.target_paths[u]) == 0) {
+                fprintf(stderr, "Error: Target path %s is given twice\n", target);
+                return 1;
+            }
+        }
+        if (options.plan) {
+            continue;
+        }
+        if (create_directory(target) != 0) {
+            return 1;
+        }
+        printf("Also writing to: %s\n", target);
+    }
     
-    // Initialize libcurl
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
+    // A preview run fills the preview cache and leaves the photos, the index and the watermarks alone.
+    // A full import upgrades the previews it finds there.
+    if (options.preview_dir[0] != '\0') {
+        snprintf(preview_dir, sizeof(preview_dir), "%s", options.preview_dir);
+    } else {
+        snprintf(preview_dir, sizeof(preview_dir), "%s/" PREVIEW_DIRNAME, base_path);
+    }
+    if (options.preview) {
+        if (create_directory(preview_dir) != 0) {
+            return 1;
+        }
+        import_path = preview_dir;
+        printf("Preview cache: %s\n", preview_dir);
+    }
     
-    if (curl) {
-        // Set URL
-        curl_easy_setopt(curl, CURLOPT_URL, "http://192.168.0.1/_gr/objs");
-        
-        // Set callback function to handle response data
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-        
-        // Set timeout
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    // Load the index of earlier imports once, so skip decisions need no filesystem probing
+    if (options.use_index && !options.preview) {
+        if (index_open(&index, base_path, options.plan) != 0) {
+            return 1;
+        }
+        index_ptr = &index;
+        printf("Import index: %zu photos\n", index.count);
+    }
+    
+    // Every camera keeps its own watermark
+    memset(cameras, 0, sizeof(cameras));
+    for (int c = 0; c < options.camera_count; c++) {
+        struct camera* cam = &cameras[c];
+        cam->url = options.cameras[c].url;
+        cam->label = options.cameras[c].label;
+        cam->wanted = 1;
         
-        // Perform the request
-        res = curl_easy_perform(curl);
+        // A selective import must not move the watermark past photos it never looked at
+        if (options.incremental) {
+            cam->have_mark = watermark_load(base_path, cam->label, options.format, &cam->mark) == 0;
+            track_mark = names.count == 0 && !options.preview;
+            if (cam->have_mark) {
+                printf("Incremental import from %s after %s/%s\n", cam->url, cam->mark.tag, cam->mark.name);
+            }
+        }
+    }
+    
+    // Initialize libcurl
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    if (session_init(&session, options.jobs, options.camera_count) == 0) {
+        session.stall_speed = options.stall_speed;
+        session.stall_time = options.stall_time;
+        for (int c = 0; c < options.camera_count; c++) {
+            TRACE_TRACK(cameras[c].url, TRACE_LISTING_TRACK + c, -1);
+            for (int s = 0; s < options.jobs; s++) {
+                TRACE_TRACK("slot", TRACE_SLOT_TRACK + c * options.jobs + s, c * options.jobs + s);
+            }
+        }
+        session.adaptive = options.adaptive;
+        session.commit_files = options.durable ? (int)options.commit_files : 0;
+        session.commit_seconds = (double)options.commit_seconds;
+        session.write_buffer = ((size_t)options.write_buffer_kb * 1024 + WRITE_ALIGN - 1) & ~(size_t)(WRITE_ALIGN - 1);
+        session.direct = options.direct;
+        session.sync_bytes = (uint64_t)options.sync_mb * 1024 * 1024;
+        session.layout = options.layout;
+        session.verify = options.verify;
+        session.targets[0].path = base_path;
+        for (int t = 1; t < options.target_count; t++) {
+            session.targets[t].path = options.target_paths[t];
+        }
+        session.target_count = options.target_count > 1 ? options.target_count : 1;
+        session.preview = options.preview;
+        struct stat st;
+        if (!options.preview && stat(preview_dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+            session.preview_dir = preview_dir;
+        }
         
-        // Check for errors
-        if (res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        // Nothing is imported when the files could not be post-processed as asked
+        if (options.plan) {
+            plan_import(&session, cameras, options.camera_count, index_ptr, &options, import_path, &priority, &names);
+        } else if ((options.post_command_count > 0 || options.post_copy[0] != '\0') &&
+            post_pool_start(&session, &post, &options, base_path) != 0) {
+            fprintf(stderr, "Post-processing unavailable, not importing\n");
+        } else if (options.write_pool_mb > 0 && write_pool_start(&session, &pool, options.write_pool_mb) != 0) {
+            fprintf(stderr, "Write pool unavailable, not importing\n");
+        } else if (options.watch) {
+            watch_cameras(&session, cameras, options.camera_count, index_ptr, &options, import_path, &priority, &names,
+                          track_mark);
         } else {
-            // Parse JSON and extract photo information
-            if (parse_photos_json(response.data, &photos, &photo_count) == 0) {
-                int downloaded = 0;
-                printf("Found %d photos matching criteria\n", photo_count);
-                
-                // Download each photo based on filters
-                for (int i = 0; i < photo_count; i++) {
-                    // Check if specific filename is requested
-                    if (options.filename[0] != '\0') {
-                        if (strcmp(photos[i].name, options.filename) != 0) {
-                            continue;
-                        }
-                    }
-                    
-                    // Check format filter
-                    if (!matches_format(photos[i].name, options.format)) {
-                        continue;
-                    }
-                    
-                    printf("Photo %d: %s, date=%s\n", 
-                           downloaded + 1, photos[i].name, photos[i].date);
-                    
-                    if (download_photo("http://192.168.0.1", photos[i].name, photos[i].tag, 
-                                     photos[i].date, base_path) == 0) {
-                        downloaded++;
+            int downloaded;
+            import_once(&session, cameras, options.camera_count, index_ptr, &options, import_path,
+                        &priority, &names, track_mark, &downloaded);
+#ifdef WITH_BENCH
+            if (bench) {
+                double* latencies = malloc((session.stat_count + 1) * sizeof(double));
+                int latency_count = 0;
+                for (int i = 0; latencies && i < session.stat_count; i++) {
+                    if (session.stats[i].ok) {
+                        latencies[latency_count++] = session.stats[i].seconds;
                     }
                 }
-                
-                printf("\nDownload complete. Downloaded %d photos to %s\n", downloaded, base_path);
-                free(photos);
-            } else {
-                fprintf(stderr, "Failed to parse JSON response\n");
+                bench_report(downloaded, session.bytes, now_seconds() - session.started, latencies, latency_count);
+                free(latencies);
             }
+#endif
         }
-        
-        // Cleanup curl
-        curl_easy_cleanup(curl);
     }
     
+    // Let the post-processing threads finish before anything they use goes away
+    if (session.post) {
+        post_pool_stop(session.post);
+    }
+    if (session.pool) {
+        write_pool_stop(session.pool);
+    }
+#ifdef WITH_TRACE
+    trace_finish();
+#endif
+    
+    // Cleanup curl
+    session_cleanup(&session);
+    
     // Cleanup
+    if (index_ptr) {
+        index_close(index_ptr);
+    }
     curl_global_cleanup();
-    if (response.data) {
-        free(response.data);
+    priority_free(&priority);
+    name_set_free(&names);
+    
+#ifdef WITH_BENCH
+    if (bench) {
+        bench_server_stop();
+        if (bench_dir[0] != '\0') {
+            bench_remove_tree(bench_dir);
+        }
     }
+#endif
     
     return 0;
 }
\ No newline at end of file
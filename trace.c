@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "trace.h"
+
+// Spans kept in memory; a long watch session stops recording instead of growing without bound
+#define TRACE_MAX_EVENTS (1 << 20)
+#define TRACE_DETAIL 64
+
+// Structure for one recorded span, or a track name when name is NULL
+struct trace_event {
+    const char* name;             // Literal span name
+    char detail[TRACE_DETAIL];    // Photo or camera, truncated; the track name for a track event
+    int track;
+    double start;
+    double end;
+};
+
+// Structure for the trace being recorded
+struct trace_state {
+    pthread_mutex_t lock;
+    int recording;
+    char* path;
+    double origin;                // trace_start() time, timestamps are relative to it
+    struct trace_event* events;
+    int count;
+    int capacity;
+    long dropped;                 // Spans past TRACE_MAX_EVENTS
+};
+
+static struct trace_state trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Function to read the monotonic clock spans are measured with, in seconds
+double trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Function to start recording spans
+int trace_start(const char* path) {
+    trace.path = strdup(path);
+    if (!trace.path) {
+        fprintf(stderr, "Not enough memory for the trace\n");
+        return -1;
+    }
+    trace.origin = trace_now();
+    trace.recording = 1;
+    return 0;
+}
+
+// Function to add an event under the lock. Returns NULL when it cannot be kept.
+static struct trace_event* trace_add(void) {
+    if (trace.count >= trace.capacity) {
+        int capacity = trace.capacity ? trace.capacity * 2 : 4096;
+        struct trace_event* grown = capacity <= TRACE_MAX_EVENTS
+                                    ? realloc(trace.events, capacity * sizeof(struct trace_event)) : NULL;
+        if (!grown) {
+            trace.dropped++;
+            return NULL;
+        }
+        trace.events = grown;
+        trace.capacity = capacity;
+    }
+    return &trace.events[trace.count++];
+}
+
+// Function to record a span of work on a track
+void trace_span(const char* name, const char* detail, int track, double start, double end) {
+    if (!trace.recording) {
+        return;
+    }
+    pthread_mutex_lock(&trace.lock);
+    struct trace_event* e = trace_add();
+    if (e) {
+        e->name = name;
+        snprintf(e->detail, sizeof(e->detail), "%s", detail ? detail : "");
+        e->track = track;
+        e->start = start;
+        e->end = end > start ? end : start;
+    }
+    pthread_mutex_unlock(&trace.lock);
+}
+
+// Function to name a track, numbered when number is not negative
+void trace_track(const char* name, int track, int number) {
+    if (!trace.recording) {
+        return;
+    }
+    pthread_mutex_lock(&trace.lock);
+    struct trace_event* e = trace_add();
+    if (e) {
+        e->name = NULL;
+        if (number >= 0) {
+            snprintf(e->detail, sizeof(e->detail), "%s %d", name, number);
+        } else {
+            snprintf(e->detail, sizeof(e->detail), "%s", name);
+        }
+        e->track = track;
+        e->start = 0;
+        e->end = 0;
+    }
+    pthread_mutex_unlock(&trace.lock);
+}
+
+// Function to write a JSON string, escaping quotes, backslashes and control characters
+static void trace_write_string(FILE* fp, const char* str) {
+    fputc('"', fp);
+    for (const unsigned char* c = (const unsigned char*)str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(fp, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(fp, "\\u%04x", *c);
+        } else {
+            fputc(*c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// Function to write the recorded spans as Chrome trace-event JSON, complete ("X") events in microseconds
+int trace_finish(void) {
+    if (!trace.recording) {
+        return 0;
+    }
+    pthread_mutex_lock(&trace.lock);
+    trace.recording = 0;
+    pthread_mutex_unlock(&trace.lock);
+    
+    int rc = 0;
+    FILE* fp = fopen(trace.path, "w");
+    if (!fp) {
+        fprintf(stderr, "Warning: cannot write trace %s: %s\n", trace.path, strerror(errno));
+        rc = -1;
+    } else {
+        fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+        for (int i = 0; i < trace.count; i++) {
+            const struct trace_event* e = &trace.events[i];
+            fprintf(fp, "%s\n  ", i ? "," : "");
+            if (!e->name) {
+                fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": ", e->track);
+                trace_write_string(fp, e->detail);
+                fprintf(fp, "}}");
+                continue;
+            }
+            fprintf(fp, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"detail\": ",
+                    e->name, e->track, (e->start - trace.origin) * 1e6, (e->end - e->start) * 1e6);
+            trace_write_string(fp, e->detail);
+            fprintf(fp, "}}");
+        }
+        fprintf(fp, "%s]}\n", trace.count ? "\n" : "");
+        if (fclose(fp) != 0) {
+            fprintf(stderr, "Warning: cannot write trace %s\n", trace.path);
+            rc = -1;
+        } else {
+            printf("Trace with %d events written to %s\n", trace.count, trace.path);
+        }
+    }
+    if (trace.dropped > 0) {
+        fprintf(stderr, "Warning: the trace is incomplete, %ld spans past %d were not recorded\n",
+                trace.dropped, TRACE_MAX_EVENTS);
+    }
+    
+    free(trace.events);
+    free(trace.path);
+    trace.events = NULL;
+    trace.path = NULL;
+    trace.count = 0;
+    trace.capacity = 0;
+    return rc;
+}
@@ -0,0 +1,38 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Tracing support, built only with -DWITH_TRACE (make trace). Without it the macros compile to
+// nothing and their arguments are never evaluated.
+
+#ifdef WITH_TRACE
+
+// Function to start recording spans, written to path as Chrome trace-event JSON by trace_finish()
+int trace_start(const char* path);
+
+// Function to read the monotonic clock spans are measured with, in seconds
+double trace_now(void);
+
+// Function to record a span of work on a track, tagged with the photo or camera it was for
+void trace_span(const char* name, const char* detail, int track, double start, double end);
+
+// Function to give a track the name a trace viewer shows for it
+void trace_track(const char* name, int track, int number);
+
+// Function to write the recorded spans and stop recording
+int trace_finish(void);
+
+#define TRACE_BEGIN(start) double start = trace_now()
+#define TRACE_END(start, name, detail, track) trace_span(name, detail, track, start, trace_now())
+#define TRACE_SPAN(name, detail, track, start, end) trace_span(name, detail, track, start, end)
+#define TRACE_TRACK(name, track, number) trace_track(name, track, number)
+
+#else
+
+#define TRACE_BEGIN(start) ((void)0)
+#define TRACE_END(start, name, detail, track) ((void)0)
+#define TRACE_SPAN(name, detail, track, start, end) ((void)0)
+#define TRACE_TRACK(name, track, number) ((void)0)
+
+#endif
+
+#endif